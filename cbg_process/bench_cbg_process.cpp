@@ -0,0 +1,187 @@
+/*!
+  Benchmark de fsiv_cbg_process.
+
+  Compara los caminos rápidos de fsiv_cbg_process y el núcleo fusionado
+  fsiv_cbg_process_fused con la implementación original basada en pasadas
+  completas de OpenCV sobre imágenes sintéticas de 1080p y 4K, y mide el
+  rendimiento para cada profundidad de entrada (8 bits, 16 bits y flotante).
+  También mide la aceleración de la gamma rápida frente a cv::pow en
+  imágenes flotantes.
+*/
+
+#include <iostream>
+#include <exception>
+#include <functional>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/core/utility.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "common_code.hpp"
+
+const cv::String keys =
+    "{help h usage ? |      | print this message.}"
+    "{n iterations   |20    | iterations per measure.}"
+    "{c contrast     |1.2   | contrast parameter.}"
+    "{b bright       |0.1   | bright parameter.}"
+    "{g gamma        |0.8   | gamma parameter.}";
+
+/**
+ * @brief Proceso sólo luma tal y como se hacía originalmente: conversión a
+ * flotante, ida y vuelta por HSV y conversión a byte.
+ */
+cv::Mat reference_luma_hsv(const cv::Mat &in, double contrast,
+                           double brightness, double gamma)
+{
+    cv::Mat hsv_img = fsiv_convert_bgr_to_hsv(fsiv_convert_image_byte_to_float(in));
+    std::vector<cv::Mat> channels;
+    cv::split(hsv_img, channels);
+    cv::pow(channels[2], gamma, channels[2]);
+    channels[2] = contrast * channels[2] + brightness;
+    cv::merge(channels, hsv_img);
+    return fsiv_convert_image_float_to_byte(fsiv_convert_hsv_to_bgr(hsv_img));
+}
+
+/**
+ * @brief Proceso de todos los canales tal y como se hacía originalmente:
+ * pasadas completas de conversión, cv::pow, escalado y desplazamiento.
+ */
+cv::Mat reference_all_channels(const cv::Mat &in, double contrast,
+                               double brightness, double gamma)
+{
+    cv::Mat out;
+    cv::pow(fsiv_convert_image_byte_to_float(in), gamma, out);
+    cv::multiply(cv::Scalar::all(contrast), out, out);
+    out += cv::Scalar::all(brightness);
+    return fsiv_convert_image_float_to_byte(out);
+}
+
+/**
+ * @brief Mide el tiempo medio en milisegundos de una llamada a f.
+ */
+double time_ms(const std::function<void()> &f, int iterations)
+{
+    f(); // warm-up.
+    cv::TickMeter tm;
+    tm.start();
+    for (int i = 0; i < iterations; ++i)
+        f();
+    tm.stop();
+    return tm.getTimeMilli() / iterations;
+}
+
+void report(const cv::String &name, double ref_ms, double new_ms,
+            const cv::Mat &ref, const cv::Mat &out)
+{
+    std::cout << "  " << name << ": reference " << ref_ms << " ms, new "
+              << new_ms << " ms, speedup " << ref_ms / new_ms
+              << "x, max abs diff " << cv::norm(ref, out, cv::NORM_INF)
+              << std::endl;
+}
+
+int main(int argc, char *const *argv)
+{
+    int retCode = EXIT_SUCCESS;
+
+    try
+    {
+        cv::CommandLineParser parser(argc, argv, keys);
+        parser.about("Benchmark the fsiv_cbg_process fast paths.");
+        if (parser.has("help"))
+        {
+            parser.printMessage();
+            return EXIT_SUCCESS;
+        }
+        const int iterations = parser.get<int>("n");
+        const double contrast = parser.get<double>("c");
+        const double bright = parser.get<double>("b");
+        const double gamma = parser.get<double>("g");
+        if (!parser.check())
+        {
+            parser.printErrors();
+            return EXIT_FAILURE;
+        }
+
+        const std::vector<cv::Size> sizes = {cv::Size(1920, 1080),
+                                             cv::Size(3840, 2160)};
+        for (size_t s = 0; s < sizes.size(); ++s)
+        {
+            cv::Mat in(sizes[s], CV_8UC3);
+            cv::randu(in, cv::Scalar::all(0), cv::Scalar::all(256));
+            std::cout << sizes[s].width << "x" << sizes[s].height << ":"
+                      << std::endl;
+
+            cv::Mat ref, out;
+            double ref_ms = time_ms([&]()
+                                    { ref = reference_luma_hsv(in, contrast, bright, gamma); },
+                                    iterations);
+            double new_ms = time_ms([&]()
+                                    { out = fsiv_cbg_process(in, contrast, bright, gamma, true); },
+                                    iterations);
+            report("luma", ref_ms, new_ms, ref, out);
+
+            CBGWorkspace ws;
+            ref_ms = time_ms([&]()
+                             { ref = reference_all_channels(in, contrast, bright, gamma); },
+                             iterations);
+            new_ms = time_ms([&]()
+                             { fsiv_cbg_process_fused(in, out, ws, contrast, bright, gamma); },
+                             iterations);
+            report("all channels, fused kernel", ref_ms, new_ms, ref, out);
+            new_ms = time_ms([&]()
+                             { fsiv_cbg_process(in, out, ws, contrast, bright, gamma, false); },
+                             iterations);
+            report("all channels, LUT", ref_ms, new_ms, ref, out);
+
+            // Throughput for each supported input depth.
+            const int depths[] = {CV_8U, CV_16U, CV_32F};
+            const char *depth_names[] = {"8U", "16U", "32F"};
+            const double scales[] = {1.0, 257.0, 1.0 / 255.0};
+            for (int d = 0; d < 3; ++d)
+            {
+                cv::Mat in_d;
+                in.convertTo(in_d, depths[d], scales[d]);
+                for (int luma = 0; luma < 2; ++luma)
+                {
+                    const double ms = time_ms([&]()
+                                              { fsiv_cbg_process(in_d, out, ws, contrast, bright, gamma, luma == 1); },
+                                              iterations);
+                    std::cout << "  depth " << depth_names[d]
+                              << (luma ? ", luma: " : ", all channels: ")
+                              << ms << " ms, " << in.total() / (ms * 1000.0)
+                              << " Mpixels/s" << std::endl;
+                }
+            }
+
+            // Fast gamma against cv::pow on float images.
+            cv::Mat in_32f;
+            in.convertTo(in_32f, CV_32F, 1.0 / 255.0);
+            ref_ms = time_ms([&]()
+                             { cv::pow(in_32f, gamma, ref); },
+                             iterations);
+            new_ms = time_ms([&]()
+                             { fsiv_fast_pow(in_32f, out, gamma); },
+                             iterations);
+            report("pow, fast gamma", ref_ms, new_ms, ref, out);
+            for (int luma = 0; luma < 2; ++luma)
+            {
+                ref_ms = time_ms([&]()
+                                 { fsiv_cbg_process(in_32f, ref, ws, contrast, bright, gamma, luma == 1, false); },
+                                 iterations);
+                new_ms = time_ms([&]()
+                                 { fsiv_cbg_process(in_32f, out, ws, contrast, bright, gamma, luma == 1, true); },
+                                 iterations);
+                report(luma ? "depth 32F, luma, fast gamma"
+                            : "depth 32F, all channels, fast gamma",
+                       ref_ms, new_ms, ref, out);
+            }
+        }
+    }
+    catch (std::exception &e)
+    {
+        std::cerr << "Exception: " << e.what() << std::endl;
+        retCode = EXIT_FAILURE;
+    }
+    return retCode;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+/**
+ * @brief Cola FIFO de capacidad limitada que se puede usar entre hilos.
+ *
+ * push() bloquea mientras la cola está llena y pop() mientras está vacía, de
+ * forma que un productor rápido no puede acumular trabajo sin límite. Tras
+ * llamar a close() no se admiten más elementos y pop() devuelve false cuando
+ * ya no quedan elementos pendientes.
+ *
+ * Cada práctica se compila por separado, así que cbg_process y color_balance
+ * tienen su propia copia de este fichero. Las dos copias deben ser idénticas:
+ * cualquier cambio en una debe hacerse también en la otra.
+ */
+template <class T>
+class BoundedQueue
+{
+public:
+    /**
+     * @brief Crea una cola vacía.
+     * @param capacity número máximo de elementos en la cola.
+     * @pre capacity > 0
+     */
+    explicit BoundedQueue(size_t capacity) : capacity_(capacity) {}
+
+    /**
+     * @brief Añade un elemento, esperando si la cola está llena.
+     * @return false si la cola se cerró y el elemento no se añadió.
+     */
+    bool push(T value)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(lock, [this]()
+                       { return closed_ || items_.size() < capacity_; });
+        if (closed_)
+            return false;
+        items_.push_back(std::move(value));
+        not_empty_.notify_one();
+        return true;
+    }
+
+    /**
+     * @brief Extrae el elemento más antiguo, esperando si la cola está vacía.
+     * @return false si la cola se cerró y ya no quedan elementos.
+     */
+    bool pop(T &value)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [this]()
+                        { return closed_ || !items_.empty(); });
+        if (items_.empty())
+            return false;
+        value = std::move(items_.front());
+        items_.pop_front();
+        not_full_.notify_one();
+        return true;
+    }
+
+    /**
+     * @brief Cierra la cola y despierta a todos los hilos que esperan en ella.
+     */
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        not_full_.notify_all();
+        not_empty_.notify_all();
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+    std::deque<T> items_;
+    size_t capacity_;
+    bool closed_ = false;
+};
@@ -11,15 +11,25 @@
 
 #include <iostream>
 #include <exception>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
 
 // Includes para OpenCV, Descomentar según los módulo utilizados.
 #include <opencv2/core/core.hpp>
 #include <opencv2/core/utility.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/videoio/videoio.hpp>
 // #include <opencv2/calib3d/calib3d.hpp>
 
 #include "common_code.hpp"
+#include "bounded_queue.hpp"
 
 const cv::String keys =
     "{help h usage ? |      | print this message.}"
@@ -28,6 +38,10 @@ const cv::String keys =
     "{c contrast     |1.0   | contrast parameter.}"
     "{b bright       |0.0   | bright parameter.}"
     "{g gamma        |1.0   | gamma parameter.}"
+    "{f fast_gamma   |      | use a fast approximation of pow() for float images.}"
+    "{v video        |      | headless video mode: @input and @output are videos.}"
+    "{batch          |      | batch mode: @input is a glob pattern and @output a directory.}"
+    "{t threads      |0     | worker threads in batch mode. Default 0 means one per CPU.}"
     "{@input         |<none>| input image.}"
     "{@output        |<none>| output image.}";
 
@@ -39,48 +53,359 @@ struct UserData
     double bright;
     double gamma;
     bool luma_is_set;
+    bool fast_gamma = false;
+    CBGWorkspace workspace;
+
+    // Interactive preview state. The fields below, and the parameters above
+    // while the preview worker runs, are protected by mutex.
+    std::mutex mutex;
+    std::condition_variable changed; // a new request or quit was signaled.
+    unsigned long request = 0;       // incremented on each parameter change.
+    bool quit = false;               // the preview worker must finish.
+    cv::Mat proxy;                   // downscaled input for a fast preview.
+    cv::Mat display;                 // last rendered image to be shown.
+    bool display_ready = false;      // display has not been shown yet.
 };
 
+// Largest side of the proxy image rendered while a slider is moving.
+const int PROXY_MAX_SIDE = 720;
+// Time without slider changes before the full resolution image is rendered.
+const std::chrono::milliseconds IDLE_DELAY(200);
+
 void process_image(UserData *p)
 {
-    p->output = fsiv_cbg_process(p->input, p->contrast, p->bright,
-                                 p->gamma, p->luma_is_set);
+    fsiv_cbg_process(p->input, p->output, p->workspace, p->contrast,
+                     p->bright, p->gamma, p->luma_is_set, p->fast_gamma);
+}
+
+/**
+ * @brief Pide al hilo de previsualización que procese los parámetros
+ * actuales.
+ * @warning Se debe llamar con el mutex de d bloqueado.
+ */
+void request_preview(UserData *d)
+{
+    ++d->request;
+    d->changed.notify_one();
 }
 
 void contrast_trackbar(int pos, void *userdata)
 {
     UserData *d = static_cast<UserData *>(userdata);
+    std::lock_guard<std::mutex> lock(d->mutex);
     d->contrast = float(pos) / 200.0 * 2.0;
     std::cout << "Set contrast to " << d->contrast << std::endl;
-    process_image(d);
-    cv::imshow("PROCESADA", d->output);
+    request_preview(d);
 }
 
 void bright_trackbar(int pos, void *userdata)
 {
     UserData *d = static_cast<UserData *>(userdata);
+    std::lock_guard<std::mutex> lock(d->mutex);
     d->bright = (float(pos) - 100.0) / 100.0;
     std::cout << "Set bright to " << d->bright << std::endl;
-    process_image(d);
-    cv::imshow("PROCESADA", d->output);
+    request_preview(d);
 }
 
 void gamma_trackbar(int pos, void *userdata)
 {
     UserData *d = static_cast<UserData *>(userdata);
+    std::lock_guard<std::mutex> lock(d->mutex);
     d->gamma = float(pos) / 200.0 * 2.0;
     std::cout << "Set gamma to " << d->gamma << std::endl;
-    process_image(d);
-    cv::imshow("PROCESADA", d->output);
+    request_preview(d);
 }
 
 void luma_trackbar(int pos, void *userdata)
 {
     UserData *d = static_cast<UserData *>(userdata);
+    std::lock_guard<std::mutex> lock(d->mutex);
     d->luma_is_set = (pos == 1);
     std::cout << "Set luma mode to state " << d->luma_is_set << std::endl;
-    process_image(d);
+    request_preview(d);
+}
+
+/**
+ * @brief Hilo que renderiza la previsualización interactiva.
+ *
+ * Siempre trabaja con los últimos parámetros y descarta las peticiones que
+ * se quedan obsoletas. Primero renderiza la imagen reducida y, cuando los
+ * deslizadores llevan IDLE_DELAY sin moverse, la imagen a resolución
+ * completa. Las imágenes se publican en display para que el hilo principal,
+ * que es el único que usa HighGUI, las muestre. La imagen reducida se publica
+ * a su tamaño: la ventana, redimensionable, la escala al mostrarla, y así no
+ * se paga un resize a resolución completa por cada movimiento.
+ */
+void preview_worker(UserData *d)
+{
+    CBGWorkspace ws;
+    cv::Mat proxy_out, full_out;
+    unsigned long done = 0;
+    std::unique_lock<std::mutex> lock(d->mutex);
+    while (true)
+    {
+        d->changed.wait(lock, [&]()
+                        { return d->quit || d->request != done; });
+        if (d->quit)
+            break;
+        const unsigned long req = d->request;
+        const double contrast = d->contrast, bright = d->bright, gamma = d->gamma;
+        const bool luma = d->luma_is_set;
+        lock.unlock();
+
+        fsiv_cbg_process(d->proxy, proxy_out, ws, contrast, bright, gamma, luma,
+                         d->fast_gamma);
+
+        lock.lock();
+        if (d->request != req)
+            continue; // stale: a newer request is waiting.
+        std::swap(d->display, proxy_out);
+        d->display_ready = true;
+
+        if (d->changed.wait_for(lock, IDLE_DELAY, [&]()
+                                { return d->quit || d->request != req; }))
+            continue; // the sliders moved again before going idle.
+        lock.unlock();
+
+        fsiv_cbg_process(d->input, full_out, ws, contrast, bright, gamma, luma,
+                         d->fast_gamma);
+
+        lock.lock();
+        if (d->request == req)
+        {
+            std::swap(d->display, full_out);
+            d->display_ready = true;
+        }
+        done = req;
+    }
+}
+
+/**
+ * @brief Bucle de la interfaz en modo interactivo.
+ *
+ * Los callbacks de los deslizadores sólo actualizan los parámetros; el
+ * proceso lo hace preview_worker en otro hilo y este bucle muestra los
+ * resultados según llegan, así la interfaz no se bloquea con imágenes
+ * grandes.
+ *
+ * @return la tecla que terminó el bucle.
+ */
+int run_interactive_preview(UserData *d)
+{
+    const double scale = std::min(1.0, double(PROXY_MAX_SIDE) /
+                                           std::max(d->input.rows, d->input.cols));
+    if (scale < 1.0)
+        cv::resize(d->input, d->proxy, cv::Size(), scale, scale, cv::INTER_AREA);
+    else
+        d->proxy = d->input;
+
+    // The window keeps the input's size whatever the size of the image shown,
+    // so the proxy is scaled up by the GUI.
+    cv::resizeWindow("PROCESADA", d->input.cols, d->input.rows);
+    cv::imshow("ORIGINAL", d->input);
     cv::imshow("PROCESADA", d->output);
+    std::thread worker(preview_worker, d);
+    {
+        std::lock_guard<std::mutex> lock(d->mutex);
+        request_preview(d);
+    }
+
+    int key = -1;
+    cv::Mat shown;
+    while (key == -1)
+    {
+        key = cv::waitKey(20);
+        {
+            std::lock_guard<std::mutex> lock(d->mutex);
+            if (d->display_ready)
+            {
+                std::swap(shown, d->display);
+                d->display_ready = false;
+            }
+        }
+        if (!shown.empty())
+        {
+            cv::imshow("PROCESADA", shown);
+            shown.release();
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(d->mutex);
+        d->quit = true;
+        d->changed.notify_one();
+    }
+    worker.join();
+
+    // The saved result is always the full resolution image.
+    process_image(d);
+    return key & 0xff;
+}
+
+/**
+ * @brief Procesa un vídeo completo sin interfaz gráfica.
+ *
+ * Los fotogramas se leen y se procesan sobre buffers reservados una sola vez.
+ * Al terminar se muestra la latencia por fotograma y los FPS sostenidos.
+ *
+ * @return el código de salida del programa.
+ */
+int process_video(const cv::String &input_name, const cv::String &output_name,
+                  const UserData &data)
+{
+    cv::VideoCapture input(input_name);
+    if (!input.isOpened())
+    {
+        std::cerr << "Error: could not open the input video '" << input_name << "'." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    cv::Mat frame;
+    if (!input.read(frame) || frame.empty())
+    {
+        std::cerr << "Error: the input video '" << input_name << "' has no frames." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    double fps = input.get(cv::CAP_PROP_FPS);
+    if (fps <= 0.0)
+        fps = 25.0;
+    const bool is_color = frame.channels() == 3;
+    cv::VideoWriter output(output_name, static_cast<int>(input.get(cv::CAP_PROP_FOURCC)),
+                           fps, frame.size(), is_color);
+    if (!output.isOpened())
+        output.open(output_name, cv::VideoWriter::fourcc('M', 'J', 'P', 'G'),
+                    fps, frame.size(), is_color);
+    if (!output.isOpened())
+    {
+        std::cerr << "Error: could not create the output video '" << output_name << "'." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    cv::Mat processed(frame.size(), frame.type());
+    CBGWorkspace workspace;
+    const double tick_ms = 1000.0 / cv::getTickFrequency();
+    double latency_sum = 0.0;
+    double latency_min = 0.0;
+    double latency_max = 0.0;
+    int frames = 0;
+    const int64 start = cv::getTickCount();
+    do
+    {
+        const int64 t0 = cv::getTickCount();
+        fsiv_cbg_process(frame, processed, workspace, data.contrast,
+                         data.bright, data.gamma, data.luma_is_set,
+                         data.fast_gamma);
+        const double latency = (cv::getTickCount() - t0) * tick_ms;
+        output.write(processed);
+
+        latency_sum += latency;
+        latency_min = frames == 0 ? latency : std::min(latency_min, latency);
+        latency_max = std::max(latency_max, latency);
+        ++frames;
+    } while (input.read(frame) && !frame.empty());
+    const double total_s = (cv::getTickCount() - start) * tick_ms / 1000.0;
+
+    std::cout << "Processed " << frames << " frames of " << processed.cols
+              << "x" << processed.rows << " in " << total_s << " s." << std::endl;
+    std::cout << "Per-frame latency (ms): mean " << latency_sum / frames
+              << " min " << latency_min << " max " << latency_max << std::endl;
+    std::cout << "Sustained FPS (decode + process + encode): "
+              << frames / total_s << std::endl;
+    std::cout << "Processing-only FPS: " << 1000.0 * frames / latency_sum
+              << std::endl;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Procesa todas las imágenes que encajan con un patrón.
+ *
+ * Un grupo fijo de hilos toma los nombres de fichero de una cola acotada y
+ * cada uno lee, procesa y guarda la imagen en el directorio de salida con el
+ * mismo nombre. Al terminar se muestra el número de imágenes por segundo.
+ *
+ * @return el código de salida del programa.
+ */
+int process_batch(const cv::String &pattern, const cv::String &output_dir,
+                  int n_threads, const UserData &data)
+{
+    std::vector<cv::String> files;
+    cv::glob(pattern, files);
+    if (files.empty())
+    {
+        std::cerr << "Error: no input images match '" << pattern << "'." << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (n_threads <= 0)
+        n_threads = cv::getNumberOfCPUs();
+
+    // Parallelism is across images, so avoid nesting OpenCV's own threads.
+    cv::setNumThreads(1);
+
+    BoundedQueue<cv::String> queue(2 * n_threads);
+    std::atomic<int> processed(0);
+    std::atomic<int> failed(0);
+    std::atomic<int64> pixels(0);
+
+    auto worker = [&]()
+    {
+        cv::String input_name;
+        cv::Mat input, output;
+        CBGWorkspace workspace;
+        while (queue.pop(input_name))
+        {
+            // An exception must not leave the thread: it would terminate the
+            // whole batch. The image is counted as failed instead.
+            try
+            {
+                input = cv::imread(input_name, cv::IMREAD_ANYDEPTH | cv::IMREAD_ANYCOLOR);
+                if (input.empty())
+                {
+                    std::cerr << "Error: could not open the input image '" << input_name << "'." << std::endl;
+                    ++failed;
+                    continue;
+                }
+                fsiv_cbg_process(input, output, workspace, data.contrast,
+                                 data.bright, data.gamma, data.luma_is_set,
+                                 data.fast_gamma);
+                const size_t slash = input_name.find_last_of("/\\");
+                const cv::String output_name = output_dir + "/" +
+                                               input_name.substr(slash == cv::String::npos ? 0 : slash + 1);
+                if (!cv::imwrite(output_name, output))
+                {
+                    std::cerr << "Error: could not save the result in file '" << output_name << "'." << std::endl;
+                    ++failed;
+                    continue;
+                }
+                pixels += static_cast<int64>(input.total());
+                ++processed;
+            }
+            catch (std::exception &e)
+            {
+                std::cerr << "Error: could not process the input image '" << input_name
+                          << "': " << e.what() << std::endl;
+                ++failed;
+            }
+        }
+    };
+
+    const int64 start = cv::getTickCount();
+    std::vector<std::thread> workers;
+    for (int i = 0; i < n_threads; ++i)
+        workers.emplace_back(worker);
+    for (size_t i = 0; i < files.size(); ++i)
+        queue.push(files[i]);
+    queue.close();
+    for (size_t i = 0; i < workers.size(); ++i)
+        workers[i].join();
+    const double total_s = (cv::getTickCount() - start) / cv::getTickFrequency();
+
+    std::cout << "Processed " << processed << " images (" << failed
+              << " failed) with " << n_threads << " threads in " << total_s
+              << " s." << std::endl;
+    std::cout << "Throughput: " << processed / total_s << " images/s, "
+              << pixels / total_s / 1.0e6 << " Mpixels/s." << std::endl;
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 int main(int argc, char *const *argv)
@@ -107,14 +432,12 @@ int main(int argc, char *const *argv)
             return 0;
         }
 
-        cv::namedWindow("ORIGINAL");
-        cv::namedWindow("PROCESADA");
-
         UserData data;
         data.contrast = parser.get<double>("c");
         data.bright = parser.get<double>("b");
         data.gamma = parser.get<double>("g");
         data.luma_is_set = parser.has("l");
+        data.fast_gamma = parser.has("f");
         int c_int = data.contrast / 2.0 * 200;
         int b_int = (data.bright + 1.0) / 2.0 * 200;
         int g_int = data.gamma / 2.0 * 200;
@@ -136,7 +459,13 @@ int main(int argc, char *const *argv)
             return EXIT_FAILURE;
         }
 
-        data.input = cv::imread(input_name, cv::IMREAD_ANYCOLOR);
+        if (parser.has("video"))
+            return process_video(input_name, output_name, data);
+        if (parser.has("batch"))
+            return process_batch(input_name, output_name,
+                                 parser.get<int>("t"), data);
+
+        data.input = cv::imread(input_name, cv::IMREAD_ANYDEPTH | cv::IMREAD_ANYCOLOR);
 
         if (data.input.empty())
         {
@@ -148,21 +477,30 @@ int main(int argc, char *const *argv)
 
         int key = 0;
 
+        cv::namedWindow("ORIGINAL");
+        // The interactive preview shows a downscaled image while the sliders
+        // move, so its window must scale what it shows.
+        cv::namedWindow("PROCESADA", parser.has("i")
+                                         ? cv::WINDOW_NORMAL | cv::WINDOW_KEEPRATIO | cv::WINDOW_GUI_EXPANDED
+                                         : cv::WINDOW_AUTOSIZE);
+
         if (parser.has("i"))
         {
-            cv::imshow("ORIGINAL", data.input);
             cv::createTrackbar("C", "PROCESADA", &c_int, 200, contrast_trackbar, &data);
             cv::createTrackbar("B", "PROCESADA", &b_int, 200, bright_trackbar, &data);
             cv::createTrackbar("G", "PROCESADA", &g_int, 200, gamma_trackbar, &data);
             cv::createTrackbar("Luma", "PROCESADA", &l_int, 1, luma_trackbar, &data);
+            key = run_interactive_preview(&data);
         }
+        else
+        {
+            process_image(&data);
 
-        process_image(&data);
-
-        cv::imshow("ORIGINAL", data.input);
-        cv::imshow("PROCESADA", data.output);
+            cv::imshow("ORIGINAL", data.input);
+            cv::imshow("PROCESADA", data.output);
 
-        key = cv::waitKey(0) & 0xff;
+            key = cv::waitKey(0) & 0xff;
+        }
 
         if (key != 27)
         {
@@ -1,4 +1,352 @@
 #include "common_code.hpp"
+#include <opencv2/core/hal/intrin.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+namespace
+{
+
+// Value of the largest level of an image depth, used to normalize it to the
+// [0,1] range. Float images are assumed to be already in that range.
+double
+max_level(int depth)
+{
+    return depth == CV_8U ? 255.0 : (depth == CV_16U ? 65535.0 : 1.0);
+}
+
+// Coefficients, lowest degree first, of the polynomials used by fast_pow.
+// LOG2_POLY approximates log2(m) for m in [1,2) as a polynomial in u = 2m-3
+// and EXP2_POLY approximates 2^t for t in [0,1) as a polynomial in v = 2t-1.
+// Both are Chebyshev interpolants, so the error is spread evenly over the
+// interval instead of growing at its ends.
+const float LOG2_POLY[7] = {5.849625007e-01f, 4.809104106e-01f,
+                            -8.015325887e-02f, 1.771559197e-02f,
+                            -4.424803749e-03f, 1.372108745e-03f,
+                            -3.838833554e-04f};
+const float EXP2_POLY[6] = {1.414213669e+00f, 4.901290770e-01f,
+                            8.493097551e-02f, 9.811737884e-03f,
+                            8.552484731e-04f, 5.917981432e-05f};
+
+// x^g = 2^(g*log2(x)) with polynomial log2 and exp2. The exponent of x is
+// taken from its bits and the integer part of g*log2(x) is put back into the
+// bits of the result, so the polynomials only cover one octave. As cv::pow
+// documents for non-integer exponents, |x| is used, and 0 gives 0.
+inline float
+fast_pow(float x, float g)
+{
+    x = std::abs(x);
+    if (!(x > 0.0f))
+        return 0.0f;
+    int32_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    const float e = static_cast<float>((bits >> 23) - 127);
+    const int32_t m_bits = (bits & 0x007fffff) | 0x3f800000;
+    float m;
+    std::memcpy(&m, &m_bits, sizeof(m));
+    const float u = 2.0f * m - 3.0f;
+    float l = LOG2_POLY[6];
+    for (int i = 5; i >= 0; --i)
+        l = l * u + LOG2_POLY[i];
+    const float y = std::min(std::max((e + l) * g, -126.0f), 127.0f);
+    const float yi = std::floor(y);
+    const float v = 2.0f * (y - yi) - 1.0f;
+    float p = EXP2_POLY[5];
+    for (int i = 4; i >= 0; --i)
+        p = p * v + EXP2_POLY[i];
+    int32_t p_bits;
+    std::memcpy(&p_bits, &p, sizeof(p_bits));
+    p_bits += static_cast<int32_t>(yi) << 23;
+    std::memcpy(&p, &p_bits, sizeof(p));
+    return p;
+}
+
+// Store dst[x] = fast_pow(src[x], g) for a row of n floats. src and dst may
+// be the same row.
+void
+fast_pow_row(const float *src, float *dst, int n, float g)
+{
+    int x = 0;
+#if CV_SIMD128
+    const cv::v_float32x4 v_g = cv::v_setall_f32(g);
+    const cv::v_float32x4 v_zero = cv::v_setzero_f32();
+    const cv::v_float32x4 v_two = cv::v_setall_f32(2.0f);
+    const cv::v_float32x4 v_minus_one = cv::v_setall_f32(-1.0f);
+    const cv::v_float32x4 v_minus_three = cv::v_setall_f32(-3.0f);
+    const cv::v_float32x4 v_y_min = cv::v_setall_f32(-126.0f);
+    const cv::v_float32x4 v_y_max = cv::v_setall_f32(127.0f);
+    const cv::v_int32x4 v_mantissa = cv::v_setall_s32(0x007fffff);
+    const cv::v_int32x4 v_one_bits = cv::v_setall_s32(0x3f800000);
+    const cv::v_int32x4 v_bias = cv::v_setall_s32(127);
+    for (; x <= n - 4; x += 4)
+    {
+        const cv::v_float32x4 v_x = cv::v_abs(cv::v_load(src + x));
+        const cv::v_int32x4 bits = cv::v_reinterpret_as_s32(v_x);
+        const cv::v_float32x4 e = cv::v_cvt_f32((bits >> 23) - v_bias);
+        const cv::v_float32x4 m = cv::v_reinterpret_as_f32((bits & v_mantissa) | v_one_bits);
+        const cv::v_float32x4 u = cv::v_fma(m, v_two, v_minus_three);
+        cv::v_float32x4 l = cv::v_setall_f32(LOG2_POLY[6]);
+        for (int i = 5; i >= 0; --i)
+            l = cv::v_fma(l, u, cv::v_setall_f32(LOG2_POLY[i]));
+        const cv::v_float32x4 y = cv::v_min(cv::v_max((e + l) * v_g, v_y_min), v_y_max);
+        const cv::v_int32x4 yi = cv::v_floor(y);
+        const cv::v_float32x4 v = cv::v_fma(y - cv::v_cvt_f32(yi), v_two, v_minus_one);
+        cv::v_float32x4 p = cv::v_setall_f32(EXP2_POLY[5]);
+        for (int i = 4; i >= 0; --i)
+            p = cv::v_fma(p, v, cv::v_setall_f32(EXP2_POLY[i]));
+        p = cv::v_reinterpret_as_f32(cv::v_reinterpret_as_s32(p) + (yi << 23));
+        cv::v_store(dst + x, cv::v_select(v_x > v_zero, p, v_zero));
+    }
+#endif
+    for (; x < n; ++x)
+        dst[x] = fast_pow(src[x], g);
+}
+
+// Raise a row of n floats to gamma in place. The approximation is only used
+// for non-integer exponents: cv::pow computes integer powers exactly by
+// repeated multiplication, which is already fast, and it gives 0^0 = 1.
+void
+pow_row(float *row, int n, double gamma, bool fast_gamma)
+{
+    if (fast_gamma && gamma != std::floor(gamma))
+    {
+        fast_pow_row(row, row, n, static_cast<float>(gamma));
+    }
+    else
+    {
+        cv::Mat m(1, n, CV_32FC1, row);
+        cv::pow(m, gamma, m);
+    }
+}
+
+// Fill the LUT that maps each level I of type T to c*I^g+b, reusing its
+// memory. It uses the same float arithmetic as the original float path so
+// both give the same values.
+template <typename T>
+void
+fill_cbg_lut(cv::Mat &lut, int type, double contrast, double brightness,
+             double gamma)
+{
+    const int levels = std::numeric_limits<T>::max() + 1;
+    const float scale = static_cast<float>(std::numeric_limits<T>::max());
+    lut.create(1, levels, type);
+    T *lut_ptr = lut.ptr<T>();
+    const float c = static_cast<float>(contrast);
+    const float b = static_cast<float>(brightness);
+    const float g = static_cast<float>(gamma);
+    for (int i = 0; i < levels; ++i)
+    {
+        const float v = c * std::pow(i / scale, g) + b;
+        lut_ptr[i] = cv::saturate_cast<T>(v * scale);
+    }
+}
+
+// Fill the gain V'/V to apply to a BGR triplet whose value V = max(B,G,R) is
+// the table index, with V' = c*V^g+b computed in [0,1]. Entry 0 is not used
+// because a black pixel has no hue and becomes the gray level lut[0].
+template <typename T>
+void
+fill_cbg_luma_gain(cv::Mat &gain, double contrast, double brightness,
+                   double gamma)
+{
+    const int levels = std::numeric_limits<T>::max() + 1;
+    const float scale = static_cast<float>(std::numeric_limits<T>::max());
+    gain.create(1, levels, CV_32FC1);
+    float *gain_ptr = gain.ptr<float>();
+    const float c = static_cast<float>(contrast);
+    const float b = static_cast<float>(brightness);
+    const float g = static_cast<float>(gamma);
+    gain_ptr[0] = 0.0f;
+    for (int v = 1; v < levels; ++v)
+        gain_ptr[v] = (c * std::pow(v / scale, g) + b) * scale / v;
+}
+
+// Make sure the workspace has the tables needed for a given depth. The
+// tables are only rebuilt when the parameters change, and the 16-bit ones
+// are only built when a 16-bit image is processed.
+void
+update_cbg_workspace(CBGWorkspace &ws, double contrast, double brightness,
+                     double gamma, int depth)
+{
+    if (!ws.valid || ws.contrast != contrast || ws.brightness != brightness ||
+        ws.gamma != gamma)
+    {
+        ws.contrast = contrast;
+        ws.brightness = brightness;
+        ws.gamma = gamma;
+        ws.valid = true;
+        ws.has_8u = false;
+        ws.has_16u = false;
+    }
+    if (depth == CV_8U && !ws.has_8u)
+    {
+        fill_cbg_lut<uchar>(ws.lut, CV_8UC1, contrast, brightness, gamma);
+        fill_cbg_luma_gain<uchar>(ws.luma_gain, contrast, brightness, gamma);
+        ws.has_8u = true;
+    }
+    else if (depth == CV_16U && !ws.has_16u)
+    {
+        fill_cbg_lut<ushort>(ws.lut_16u, CV_16UC1, contrast, brightness, gamma);
+        fill_cbg_luma_gain<ushort>(ws.luma_gain_16u, contrast, brightness, gamma);
+        ws.has_16u = true;
+    }
+}
+
+// Process only the V channel of an integer BGR image in one pass.
+//
+// Changing only V in HSV scales the three BGR components by the same factor
+// V'/V, so there is no need to go through the HSV color space. It is safe to
+// call it with out sharing the data of in.
+template <typename T>
+void
+cbg_luma_kernel_lut(const cv::Mat &in, cv::Mat &out, const cv::Mat &lut,
+                    const cv::Mat &luma_gain)
+{
+    CV_Assert(in.channels() == 3);
+    out.create(in.rows, in.cols, in.type());
+    const T *lut_ptr = lut.ptr<T>();
+    const float *gain_ptr = luma_gain.ptr<float>();
+    cv::parallel_for_(cv::Range(0, in.rows), [&](const cv::Range &rows)
+    {
+        for (int y = rows.start; y < rows.end; ++y)
+        {
+            const T *src = in.ptr<T>(y);
+            T *dst = out.ptr<T>(y);
+            for (int x = 0; x < in.cols; ++x, src += 3, dst += 3)
+            {
+                const T v = std::max(src[0], std::max(src[1], src[2]));
+                if (v == 0)
+                {
+                    dst[0] = dst[1] = dst[2] = lut_ptr[0];
+                }
+                else
+                {
+                    const float k = gain_ptr[v];
+                    dst[0] = cv::saturate_cast<T>(src[0] * k);
+                    dst[1] = cv::saturate_cast<T>(src[1] * k);
+                    dst[2] = cv::saturate_cast<T>(src[2] * k);
+                }
+            }
+        }
+    });
+}
+
+// Same as cbg_luma_kernel_lut for float images, where V' is computed per
+// pixel because there is no finite set of levels to tabulate.
+void
+cbg_luma_kernel_32f(const cv::Mat &in, cv::Mat &out, double contrast,
+                    double brightness, double gamma, bool fast_gamma)
+{
+    CV_Assert(in.type() == CV_32FC3);
+    out.create(in.rows, in.cols, in.type());
+    const float c = static_cast<float>(contrast);
+    const float b = static_cast<float>(brightness);
+    const float g = static_cast<float>(gamma);
+    const float black = c * std::pow(0.0f, g) + b;
+    const bool use_fast_pow = fast_gamma && gamma != std::floor(gamma);
+    cv::parallel_for_(cv::Range(0, in.rows), [&](const cv::Range &rows)
+    {
+        for (int y = rows.start; y < rows.end; ++y)
+        {
+            const float *src = in.ptr<float>(y);
+            float *dst = out.ptr<float>(y);
+            for (int x = 0; x < in.cols; ++x, src += 3, dst += 3)
+            {
+                const float v = std::max(src[0], std::max(src[1], src[2]));
+                if (v <= 0.0f)
+                {
+                    dst[0] = dst[1] = dst[2] = black;
+                }
+                else
+                {
+                    const float v_g = use_fast_pow ? fast_pow(v, g) : std::pow(v, g);
+                    const float k = (c * v_g + b) / v;
+                    dst[0] = src[0] * k;
+                    dst[1] = src[1] * k;
+                    dst[2] = src[2] * k;
+                }
+            }
+        }
+    });
+}
+
+// Apply a 65536-entry LUT to a 16-bit image. cv::LUT only accepts 8-bit
+// sources.
+void
+apply_lut_16u(const cv::Mat &in, cv::Mat &out, const cv::Mat &lut)
+{
+    out.create(in.rows, in.cols, in.type());
+    const ushort *lut_ptr = lut.ptr<ushort>();
+    const int row_len = in.cols * in.channels();
+    cv::parallel_for_(cv::Range(0, in.rows), [&](const cv::Range &rows)
+    {
+        for (int y = rows.start; y < rows.end; ++y)
+        {
+            const ushort *src = in.ptr<ushort>(y);
+            ushort *dst = out.ptr<ushort>(y);
+            for (int x = 0; x < row_len; ++x)
+                dst[x] = lut_ptr[src[x]];
+        }
+    });
+}
+
+// Store dst[x] = saturate(c*src[x]+b) for a row of n floats.
+void
+scale_bias_row(const float *src, uchar *dst, int n, float c, float b)
+{
+    int x = 0;
+#if CV_SIMD128
+    const cv::v_float32x4 v_c = cv::v_setall_f32(c);
+    const cv::v_float32x4 v_b = cv::v_setall_f32(b);
+    for (; x <= n - 16; x += 16)
+    {
+        const cv::v_int32x4 i0 = cv::v_round(cv::v_fma(cv::v_load(src + x), v_c, v_b));
+        const cv::v_int32x4 i1 = cv::v_round(cv::v_fma(cv::v_load(src + x + 4), v_c, v_b));
+        const cv::v_int32x4 i2 = cv::v_round(cv::v_fma(cv::v_load(src + x + 8), v_c, v_b));
+        const cv::v_int32x4 i3 = cv::v_round(cv::v_fma(cv::v_load(src + x + 12), v_c, v_b));
+        cv::v_store(dst + x, cv::v_pack_u(cv::v_pack(i0, i1), cv::v_pack(i2, i3)));
+    }
+#endif
+    for (; x < n; ++x)
+        dst[x] = cv::saturate_cast<uchar>(src[x] * c + b);
+}
+
+void
+scale_bias_row(const float *src, ushort *dst, int n, float c, float b)
+{
+    int x = 0;
+#if CV_SIMD128
+    const cv::v_float32x4 v_c = cv::v_setall_f32(c);
+    const cv::v_float32x4 v_b = cv::v_setall_f32(b);
+    for (; x <= n - 8; x += 8)
+    {
+        const cv::v_int32x4 i0 = cv::v_round(cv::v_fma(cv::v_load(src + x), v_c, v_b));
+        const cv::v_int32x4 i1 = cv::v_round(cv::v_fma(cv::v_load(src + x + 4), v_c, v_b));
+        cv::v_store(dst + x, cv::v_pack_u(i0, i1));
+    }
+#endif
+    for (; x < n; ++x)
+        dst[x] = cv::saturate_cast<ushort>(src[x] * c + b);
+}
+
+// Float output is not saturated, as in the original float path.
+void
+scale_bias_row(const float *src, float *dst, int n, float c, float b)
+{
+    int x = 0;
+#if CV_SIMD128
+    const cv::v_float32x4 v_c = cv::v_setall_f32(c);
+    const cv::v_float32x4 v_b = cv::v_setall_f32(b);
+    for (; x <= n - 4; x += 4)
+        cv::v_store(dst + x, cv::v_fma(cv::v_load(src + x), v_c, v_b));
+#endif
+    for (; x < n; ++x)
+        dst[x] = src[x] * c + b;
+}
+
+} // namespace
 
 cv::Mat
 fsiv_convert_image_byte_to_float(const cv::Mat &img)
@@ -67,12 +415,91 @@ fsiv_convert_hsv_to_bgr(const cv::Mat &img)
 }
 
 cv::Mat
-fsiv_cbg_process(const cv::Mat &in,
+fsiv_create_cbg_lut(double contrast, double brightness, double gamma)
+{
+    cv::Mat lut;
+    fill_cbg_lut<uchar>(lut, CV_8UC1, contrast, brightness, gamma);
+
+    CV_Assert(lut.type() == CV_8UC1);
+    CV_Assert(lut.total() == 256);
+    return lut;
+}
+
+void
+fsiv_fast_pow(const cv::Mat &src, cv::Mat &dst, double power)
+{
+    CV_Assert(src.depth() == CV_32F);
+    CV_Assert(power >= 0.0);
+    if (power == std::floor(power))
+    {
+        cv::pow(src, power, dst);
+        return;
+    }
+    dst.create(src.rows, src.cols, src.type());
+    const int row_len = src.cols * src.channels();
+    const float g = static_cast<float>(power);
+    cv::parallel_for_(cv::Range(0, src.rows), [&](const cv::Range &rows)
+    {
+        for (int y = rows.start; y < rows.end; ++y)
+            fast_pow_row(src.ptr<float>(y), dst.ptr<float>(y), row_len, g);
+    });
+
+    CV_Assert(dst.size() == src.size() && dst.type() == src.type());
+}
+
+void
+fsiv_cbg_process_fused(const cv::Mat &in, cv::Mat &out, CBGWorkspace &ws,
+                       double contrast, double brightness, double gamma,
+                       bool fast_gamma)
+{
+    const int depth = in.depth();
+    CV_Assert(depth == CV_8U || depth == CV_16U || depth == CV_32F);
+    out.create(in.rows, in.cols, in.type());
+
+    // Each stripe is a band of rows with its own row of float scratch, so a
+    // row goes through the conversion, pow, scale, bias and saturation steps
+    // while it is still in cache.
+    const int row_len = in.cols * in.channels();
+    const int n_stripes = std::max(1, std::min(in.rows, 4 * cv::getNumThreads()));
+    ws.row_buffer.create(n_stripes, row_len, CV_32FC1);
+
+    // The output is in [0,max_level], so fold that scale into c and b.
+    const double scale = max_level(depth);
+    const float c = static_cast<float>(scale * contrast);
+    const float b = static_cast<float>(scale * brightness);
+    cv::parallel_for_(cv::Range(0, n_stripes), [&](const cv::Range &stripes)
+    {
+        for (int s = stripes.start; s < stripes.end; ++s)
+        {
+            cv::Mat buffer = ws.row_buffer.row(s);
+            float *buffer_ptr = buffer.ptr<float>();
+            const int y_end = (s + 1) * in.rows / n_stripes;
+            for (int y = s * in.rows / n_stripes; y < y_end; ++y)
+            {
+                in.row(y).reshape(1, 1).convertTo(buffer, CV_32F, 1.0 / scale);
+                if (gamma != 1.0)
+                    pow_row(buffer_ptr, row_len, gamma, fast_gamma);
+                if (depth == CV_8U)
+                    scale_bias_row(buffer_ptr, out.ptr<uchar>(y), row_len, c, b);
+                else if (depth == CV_16U)
+                    scale_bias_row(buffer_ptr, out.ptr<ushort>(y), row_len, c, b);
+                else
+                    scale_bias_row(buffer_ptr, out.ptr<float>(y), row_len, c, b);
+            }
+        }
+    }, n_stripes);
+
+    CV_Assert(out.rows == in.rows && out.cols == in.cols);
+    CV_Assert(out.type() == in.type());
+}
+
+void
+fsiv_cbg_process(const cv::Mat &in, cv::Mat &out, CBGWorkspace &ws,
                  double contrast, double brightness, double gamma,
-                 bool only_luma)
+                 bool only_luma, bool fast_gamma)
 {
-    CV_Assert(in.depth() == CV_8U);
-    cv::Mat out;
+    const int depth = in.depth();
+    CV_Assert(depth == CV_8U || depth == CV_16U || depth == CV_32F);
     // TODO
     // Hint: convert to float range [0,1] before processing the image.
     // Hint: use cv::pow() to apply the gamma parameter.
@@ -81,29 +508,52 @@ fsiv_cbg_process(const cv::Mat &in,
     // 
     //* I' = c x I^g + b
 
-    cv::Mat float_img = fsiv_convert_image_byte_to_float(in);
-
-    if (in.channels() == 3 and only_luma) {
-        cv::Mat hsv_img = fsiv_convert_bgr_to_hsv(float_img);
-        std::vector<cv::Mat> channels;
+    update_cbg_workspace(ws, contrast, brightness, gamma, depth);
+    const bool luma = in.channels() == 3 and only_luma;
 
-        cv::split(hsv_img, channels);
-        cv::pow(channels[2], gamma, channels[2]);
-
-        channels[2] = contrast * channels[2] + brightness;
-        cv::merge(channels, hsv_img);
-
-        out = fsiv_convert_hsv_to_bgr(hsv_img);
+    if (depth == CV_8U) {
+        // With 8 bits there are only 256 possible inputs, so a single LUT
+        // pass replaces the float conversion, pow, scale and bias passes.
+        if (luma)
+            cbg_luma_kernel_lut<uchar>(in, out, ws.lut, ws.luma_gain);
+        else
+            cv::LUT(in, ws.lut, out);
+    } else if (depth == CV_16U) {
+        if (luma)
+            cbg_luma_kernel_lut<ushort>(in, out, ws.lut_16u, ws.luma_gain_16u);
+        else
+            apply_lut_16u(in, out, ws.lut_16u);
     } else {
-        cv::pow(float_img, gamma, out);
-        cv::multiply(cv::Scalar::all(contrast), out, out);
-        out += cv::Scalar::all(brightness);
+        if (luma)
+            cbg_luma_kernel_32f(in, out, contrast, brightness, gamma, fast_gamma);
+        else
+            fsiv_cbg_process_fused(in, out, ws, contrast, brightness, gamma,
+                                   fast_gamma);
     }
 
-    out = fsiv_convert_image_float_to_byte(out);
-
     CV_Assert(out.rows == in.rows && out.cols == in.cols);
-    CV_Assert(out.depth() == CV_8U);
+    CV_Assert(out.depth() == in.depth());
     CV_Assert(out.channels() == in.channels());
+}
+
+void
+fsiv_cbg_process(const cv::Mat &in, cv::Mat &out,
+                 double contrast, double brightness, double gamma,
+                 bool only_luma, bool fast_gamma)
+{
+    // One workspace per thread so concurrent callers do not share tables.
+    static thread_local CBGWorkspace ws;
+    fsiv_cbg_process(in, out, ws, contrast, brightness, gamma, only_luma,
+                     fast_gamma);
+}
+
+cv::Mat
+fsiv_cbg_process(const cv::Mat &in,
+                 double contrast, double brightness, double gamma,
+                 bool only_luma, bool fast_gamma)
+{
+    cv::Mat out;
+    fsiv_cbg_process(in, out, contrast, brightness, gamma, only_luma,
+                     fast_gamma);
     return out;
 }
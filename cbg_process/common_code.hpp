@@ -35,6 +35,20 @@ cv::Mat fsiv_convert_bgr_to_hsv(const cv::Mat &img);
  */
 cv::Mat fsiv_convert_hsv_to_bgr(const cv::Mat &img);
 
+/**
+ * @brief Crea la tabla de consulta (LUT) que aplica O = c * I^g + b a una
+ * imagen de 8 bits.
+ *
+ * La entrada i de la tabla es el resultado de procesar el nivel i/255 en el
+ * rango [0,1] y volverlo a convertir a [0,255] con saturación.
+ *
+ * @param contrast controla el ajuste del contraste.
+ * @param brightness controla el ajuste del brillo.
+ * @param gamma controla el ajuste de la gamma.
+ * @return la tabla, de tipo CV_8UC1 con 256 entradas.
+ */
+cv::Mat fsiv_create_cbg_lut(double contrast, double brightness, double gamma);
+
 /**
  * @brief Realiza un control del brillo/contraste/gamma de la imagen.
  *
@@ -42,16 +56,145 @@ cv::Mat fsiv_convert_hsv_to_bgr(const cv::Mat &img);
  *
  * O = c * I^g + b
  *
- * Si la imagen es RGB y el flag only_luma es true, se utiliza el espacio HSV
- * para procesar sólo el canal V (luma).
+ * Si la imagen es RGB y el flag only_luma es true, sólo se procesa el canal V
+ * (luma) del espacio HSV. Como modificar V equivale a escalar las tres
+ * componentes BGR por V'/V, se hace en una sola pasada sin convertir a HSV.
+ *
+ * La imagen puede ser de 8 bits, 16 bits o flotante. Los niveles se
+ * normalizan a [0,1] dividiendo por 255, por 65535 o sin cambios en el caso
+ * flotante, y la salida tiene la misma profundidad que la entrada.
+ *
+ * Las imágenes de 8 y 16 bits se procesan con tablas de consulta de 256 y
+ * 65536 entradas en una única pasada. Las tablas se guardan en un
+ * CBGWorkspace por hilo y sólo se recalculan cuando cambia la tripleta
+ * (c, b, g). Las imágenes flotantes usan fsiv_cbg_process_fused.
+ *
+ * Con fast_gamma, las imágenes flotantes calculan I^g con fsiv_fast_pow en
+ * lugar de cv::pow cuando g no es entero. En 8 y 16 bits no tiene efecto
+ * porque las tablas ya son exactas.
  *
  * @param img  imagen de entrada.
  * @param contrast controla el ajuste del contraste.
  * @param brightness controla el ajuste del brillo.
  * @param gamma controla el ajuste de la gamma.
  * @param only_luma si es true sólo se procesa el canal Luma.
+ * @param fast_gamma si es true usa la aproximación rápida de la gamma.
  * @return la imagen procesada.
+ * @pre img.depth() es CV_8U, CV_16U o CV_32F.
+ * @post ret_v.depth() == img.depth()
  */
 cv::Mat fsiv_cbg_process(const cv::Mat &img,
                          double contrast = 1.0, double brightness = 0.0, double gamma = 1.0,
-                         bool only_luma = true);
+                         bool only_luma = true, bool fast_gamma = false);
+
+/**
+ * @brief Igual que fsiv_cbg_process pero deja el resultado en una imagen
+ * del llamador.
+ *
+ * Si out ya tiene el tamaño y tipo de la salida se reutiliza su memoria, así
+ * que procesar una secuencia de imágenes del mismo tamaño no reserva memoria
+ * en cada llamada.
+ *
+ * @param img  imagen de entrada.
+ * @param out  imagen de salida.
+ * @param contrast controla el ajuste del contraste.
+ * @param brightness controla el ajuste del brillo.
+ * @param gamma controla el ajuste de la gamma.
+ * @param only_luma si es true sólo se procesa el canal Luma.
+ * @param fast_gamma si es true usa la aproximación rápida de la gamma.
+ */
+void fsiv_cbg_process(const cv::Mat &img, cv::Mat &out,
+                      double contrast = 1.0, double brightness = 0.0, double gamma = 1.0,
+                      bool only_luma = true, bool fast_gamma = false);
+
+/**
+ * @brief Espacio de trabajo reutilizable por fsiv_cbg_process.
+ *
+ * Guarda las tablas calculadas para la última tripleta (c, b, g). Si se pasa
+ * siempre el mismo objeto, tras la primera llamada fsiv_cbg_process no
+ * reserva memoria aunque cambien los parámetros, porque las tablas se
+ * rellenan sobre la memoria que ya tienen.
+ */
+struct CBGWorkspace
+{
+    double contrast = 0.0;   // contraste con el que se calcularon las tablas.
+    double brightness = 0.0; // brillo con el que se calcularon las tablas.
+    double gamma = 0.0;      // gamma con la que se calcularon las tablas.
+    bool valid = false;      // los parámetros anteriores son válidos.
+    bool has_8u = false;     // lut y luma_gain están calculadas.
+    bool has_16u = false;    // lut_16u y luma_gain_16u están calculadas.
+    cv::Mat lut;             // tabla 1x256 CV_8U con O = c*I^g+b por nivel.
+    cv::Mat luma_gain;       // tabla 1x256 CV_32F con V'/V por nivel de V.
+    cv::Mat lut_16u;         // tabla 1x65536 CV_16U con O = c*I^g+b por nivel.
+    cv::Mat luma_gain_16u;   // tabla 1x65536 CV_32F con V'/V por nivel de V.
+    cv::Mat row_buffer;      // una fila flotante por banda de fsiv_cbg_process_fused.
+};
+
+/**
+ * @brief Igual que fsiv_cbg_process pero sin reservar memoria una vez que
+ * out y ws tienen el tamaño adecuado.
+ *
+ * Pensada para bucles de vídeo y callbacks interactivos que procesan muchas
+ * veces imágenes del mismo tamaño.
+ *
+ * @param img  imagen de entrada.
+ * @param out  imagen de salida. Se reutiliza su memoria si ya tiene el tamaño
+ *             y tipo de la salida.
+ * @param ws   espacio de trabajo. Debe usarse desde un único hilo a la vez.
+ * @param contrast controla el ajuste del contraste.
+ * @param brightness controla el ajuste del brillo.
+ * @param gamma controla el ajuste de la gamma.
+ * @param only_luma si es true sólo se procesa el canal Luma.
+ * @param fast_gamma si es true usa la aproximación rápida de la gamma.
+ */
+void fsiv_cbg_process(const cv::Mat &img, cv::Mat &out, CBGWorkspace &ws,
+                      double contrast = 1.0, double brightness = 0.0, double gamma = 1.0,
+                      bool only_luma = true, bool fast_gamma = false);
+
+/**
+ * @brief Aplica O = c * I^g + b a todos los canales con un único núcleo
+ * fusionado.
+ *
+ * La imagen se divide en bandas de filas que se procesan en paralelo con
+ * cv::parallel_for_. Cada fila se convierte a flotante, se le aplica la gamma
+ * y el escalado, el desplazamiento y la saturación se hacen con intrínsecos
+ * universales de OpenCV, todo mientras la fila sigue en caché. Así se evitan
+ * las pasadas completas sobre la imagen del proceso original.
+ *
+ * @param img  imagen de entrada.
+ * @param out  imagen de salida, del mismo tipo que la entrada.
+ * @param ws   espacio de trabajo con la memoria auxiliar de cada banda.
+ * @param contrast controla el ajuste del contraste.
+ * @param brightness controla el ajuste del brillo.
+ * @param gamma controla el ajuste de la gamma.
+ * @param fast_gamma si es true usa fsiv_fast_pow en lugar de cv::pow.
+ * @pre img.depth() es CV_8U, CV_16U o CV_32F.
+ */
+void fsiv_cbg_process_fused(const cv::Mat &img, cv::Mat &out, CBGWorkspace &ws,
+                            double contrast = 1.0, double brightness = 0.0,
+                            double gamma = 1.0, bool fast_gamma = false);
+
+/**
+ * @brief Calcula dst = src^power con una aproximación rápida de cv::pow.
+ *
+ * Usa x^g = 2^(g*log2(x)), con log2 y 2^t aproximados por polinomios de
+ * Chebyshev de grados 6 y 5 sobre una octava y evaluados con intrínsecos
+ * universales de OpenCV. El exponente binario de x se toma de sus bits, así
+ * que no hace falta ninguna tabla.
+ *
+ * Error máximo: para x en [2^-16, 1] y power en [0, 3], es decir, niveles de
+ * imágenes de hasta 16 bits normalizados, el error relativo frente a cv::pow
+ * es menor que 1e-5, muy inferior al paso de cuantificación de 8 o 16 bits.
+ * En general, mientras x^power >= FLT_MIN, el error relativo es menor que
+ * 6e-6 + 1e-7 * |power * log2(x)|. Como documenta cv::pow para exponentes
+ * no enteros, se usa |x|, así que x < 0 da |x|^power y x = 0 da 0. Si power
+ * es entero se usa directamente cv::pow, que en ese caso ya es exacto y
+ * rápido.
+ *
+ * @param src imagen flotante de entrada.
+ * @param dst imagen de salida, del mismo tamaño y tipo. Puede ser src.
+ * @param power exponente.
+ * @pre src.depth() == CV_32F
+ * @pre power >= 0
+ */
+void fsiv_fast_pow(const cv::Mat &src, cv::Mat &dst, double power);
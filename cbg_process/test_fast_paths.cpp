@@ -0,0 +1,256 @@
+/*!
+  Test de los caminos rápidos de fsiv_cbg_process.
+
+  Comprueba que los resultados coinciden con el proceso original en flotante,
+  que la aproximación rápida de la gamma respeta su error máximo frente a
+  cv::pow y que la versión con espacio de trabajo no reserva memoria tras la
+  primera llamada.
+*/
+
+#include <cmath>
+#include <iostream>
+#include <exception>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/core/utility.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "common_code.hpp"
+
+static int failures = 0;
+
+static void check(bool condition, const char *what)
+{
+    std::cout << (condition ? "[OK]   " : "[FAIL] ") << what << std::endl;
+    if (!condition)
+        ++failures;
+}
+
+/**
+ * @brief Proceso original en flotante, usado como referencia.
+ */
+static cv::Mat reference_cbg(const cv::Mat &in, double contrast,
+                             double brightness, double gamma, bool only_luma)
+{
+    cv::Mat out, float_img = fsiv_convert_image_byte_to_float(in);
+    if (in.channels() == 3 && only_luma)
+    {
+        cv::Mat hsv_img = fsiv_convert_bgr_to_hsv(float_img);
+        std::vector<cv::Mat> channels;
+        cv::split(hsv_img, channels);
+        cv::pow(channels[2], gamma, channels[2]);
+        channels[2] = contrast * channels[2] + brightness;
+        cv::merge(channels, hsv_img);
+        out = fsiv_convert_hsv_to_bgr(hsv_img);
+    }
+    else
+    {
+        cv::pow(float_img, gamma, out);
+        cv::multiply(cv::Scalar::all(contrast), out, out);
+        out += cv::Scalar::all(brightness);
+    }
+    return fsiv_convert_image_float_to_byte(out);
+}
+
+static void test_matches_reference()
+{
+    cv::Mat color(97, 131, CV_8UC3), gray(97, 131, CV_8UC1);
+    cv::randu(color, cv::Scalar::all(0), cv::Scalar::all(256));
+    cv::randu(gray, cv::Scalar::all(0), cv::Scalar::all(256));
+    const double params[][3] = {{1.0, 0.0, 1.0}, {1.5, -0.2, 0.5}, {0.7, 0.3, 1.8}};
+    for (size_t i = 0; i < sizeof(params) / sizeof(params[0]); ++i)
+    {
+        const double c = params[i][0], b = params[i][1], g = params[i][2];
+        check(cv::norm(fsiv_cbg_process(gray, c, b, g, false),
+                       reference_cbg(gray, c, b, g, false), cv::NORM_INF) <= 1.0,
+              "gray LUT path matches the float path");
+        check(cv::norm(fsiv_cbg_process(color, c, b, g, false),
+                       reference_cbg(color, c, b, g, false), cv::NORM_INF) <= 1.0,
+              "color LUT path matches the float path");
+        CBGWorkspace ws;
+        cv::Mat fused;
+        fsiv_cbg_process_fused(color, fused, ws, c, b, g);
+        check(cv::norm(fused, reference_cbg(color, c, b, g, false),
+                       cv::NORM_INF) <= 1.0,
+              "fused kernel matches the float path");
+        check(cv::norm(fsiv_cbg_process(color, c, b, g, true),
+                       reference_cbg(color, c, b, g, true), cv::NORM_INF) <= 1.0,
+              "fused luma path matches the HSV path");
+    }
+}
+
+static void test_high_bit_depths()
+{
+    cv::Mat color(53, 71, CV_16UC3);
+    cv::randu(color, cv::Scalar::all(0), cv::Scalar::all(65536));
+    const double c = 1.3, b = -0.1, g = 0.7;
+
+    cv::Mat expected;
+    color.convertTo(expected, CV_32F, 1.0 / 65535.0);
+    cv::pow(expected, g, expected);
+    expected = c * expected + b;
+
+    cv::Mat out_16u;
+    fsiv_cbg_process(color, c, b, g, false).convertTo(out_16u, CV_32F, 1.0 / 65535.0);
+    cv::Mat expected_16u;
+    cv::min(cv::max(expected, 0.0), 1.0, expected_16u);
+    check(cv::norm(out_16u, expected_16u, cv::NORM_INF) <= 1.5 / 65535.0,
+          "16-bit LUT path matches c*I^g+b");
+
+    cv::Mat color_32f;
+    color.convertTo(color_32f, CV_32F, 1.0 / 65535.0);
+    const cv::Mat out_32f = fsiv_cbg_process(color_32f, c, b, g, false);
+    check(out_32f.type() == CV_32FC3 &&
+              cv::norm(out_32f, expected, cv::NORM_INF) <= 1.0e-5,
+          "float path matches c*I^g+b");
+
+    cv::Mat luma_16u, luma_32f;
+    fsiv_cbg_process(color, c, b, g, true).convertTo(luma_16u, CV_32F, 1.0 / 65535.0);
+    cv::min(cv::max(fsiv_cbg_process(color_32f, c, b, g, true), 0.0), 1.0, luma_32f);
+    check(cv::norm(luma_16u, luma_32f, cv::NORM_INF) <= 2.0 / 65535.0,
+          "16-bit and float luma paths agree");
+}
+
+static void test_fast_gamma()
+{
+    // Normalized levels of images of up to 16 bits, plus some zeros.
+    cv::Mat in(67, 129, CV_32FC3);
+    cv::randu(in, cv::Scalar::all(1.0 / 65536.0), cv::Scalar::all(1.0));
+    in.row(0).setTo(0.0);
+
+    bool within_bound = true;
+    const double gammas[] = {0.05, 0.3, 0.5, 0.8, 1.5, 2.2, 3.0};
+    for (size_t i = 0; i < sizeof(gammas) / sizeof(gammas[0]); ++i)
+    {
+        cv::Mat expected, out, err;
+        cv::pow(in, gammas[i], expected);
+        fsiv_fast_pow(in, out, gammas[i]);
+        cv::absdiff(out, expected, err);
+        const cv::Mat tolerance = expected * 1.0e-5;
+        const cv::Mat outside = err > tolerance;
+        within_bound = within_bound && out.type() == in.type() &&
+                       cv::countNonZero(outside.reshape(1)) == 0;
+    }
+    check(within_bound, "fsiv_fast_pow relative error is below 1e-5");
+
+    // Negative levels give |x|^g, as cv::pow documents for non-integer
+    // exponents. The reference is taken on |x| because newer cv::pow
+    // versions return NaN there instead.
+    const cv::Mat negative = -in;
+    bool matches_abs = true;
+    for (size_t i = 0; i < sizeof(gammas) / sizeof(gammas[0]); ++i)
+    {
+        if (gammas[i] == std::floor(gammas[i]))
+            continue;
+        cv::Mat expected, out, err;
+        cv::pow(in, gammas[i], expected);
+        fsiv_fast_pow(negative, out, gammas[i]);
+        cv::absdiff(out, expected, err);
+        const cv::Mat tolerance = expected * 1.0e-5;
+        const cv::Mat outside = err > tolerance;
+        matches_abs = matches_abs && cv::countNonZero(outside.reshape(1)) == 0;
+    }
+    check(matches_abs, "fsiv_fast_pow gives |x|^g for negative values");
+
+    cv::Mat expected, out;
+    cv::pow(in, 2.0, expected);
+    fsiv_fast_pow(in, out, 2.0);
+    check(cv::norm(out, expected, cv::NORM_INF) == 0.0,
+          "fsiv_fast_pow is exact for integer exponents");
+
+    const double c = 1.3, b = -0.1, g = 0.7;
+    for (int luma = 0; luma < 2; ++luma)
+    {
+        const cv::Mat exact = fsiv_cbg_process(in, c, b, g, luma == 1, false);
+        const cv::Mat fast = fsiv_cbg_process(in, c, b, g, luma == 1, true);
+        check(cv::norm(fast, exact, cv::NORM_INF) <= 2.0e-5,
+              luma ? "float luma path with fast gamma matches cv::pow"
+                   : "fused kernel with fast gamma matches cv::pow");
+    }
+
+    cv::Mat color(31, 45, CV_8UC3);
+    cv::randu(color, cv::Scalar::all(0), cv::Scalar::all(256));
+    check(cv::norm(fsiv_cbg_process(color, c, b, g, false, true),
+                   fsiv_cbg_process(color, c, b, g, false, false),
+                   cv::NORM_INF) == 0.0,
+          "fast gamma does not change the 8-bit LUT path");
+}
+
+static void test_workspace_does_not_allocate(int depth, const char *what)
+{
+    const double max_value = depth == CV_8U ? 256.0 : depth == CV_16U ? 65536.0 : 1.0;
+    cv::Mat in(64, 80, CV_MAKETYPE(depth, 3));
+    cv::randu(in, cv::Scalar::all(0), cv::Scalar::all(max_value));
+    cv::Mat out;
+    CBGWorkspace ws;
+
+    // Warm-up calls: out and the workspace tables or the row buffer are
+    // allocated here, once for the luma path and once for the whole image.
+    fsiv_cbg_process(in, out, ws, 1.2, 0.1, 0.8, true);
+    fsiv_cbg_process(in, out, ws, 1.2, 0.1, 0.8, false);
+    const uchar *out_data = out.data;
+    const uchar *lut_data = ws.lut.data;
+    const uchar *gain_data = ws.luma_gain.data;
+    const uchar *lut_16u_data = ws.lut_16u.data;
+    const uchar *gain_16u_data = ws.luma_gain_16u.data;
+    const uchar *row_data = ws.row_buffer.data;
+
+    bool stable = true;
+    const double gammas[] = {0.8, 0.5, 1.5, 2.0};
+    for (int luma = 0; luma < 2; ++luma)
+        for (size_t i = 0; i < sizeof(gammas) / sizeof(gammas[0]); ++i)
+        {
+            fsiv_cbg_process(in, out, ws, 1.0 + 0.1 * i, -0.1 * i, gammas[i],
+                             luma == 1);
+            stable = stable && out.data == out_data &&
+                     ws.lut.data == lut_data && ws.luma_gain.data == gain_data &&
+                     ws.lut_16u.data == lut_16u_data &&
+                     ws.luma_gain_16u.data == gain_16u_data &&
+                     ws.row_buffer.data == row_data;
+        }
+    check(stable, what);
+
+    // Each depth must have used its own buffers, otherwise the check above
+    // would only compare null pointers.
+    if (depth == CV_8U)
+        check(ws.lut.total() == 256 && ws.luma_gain.total() == 256,
+              "8-bit tables have 256 entries");
+    else if (depth == CV_16U)
+        check(ws.lut_16u.total() == 65536 && ws.luma_gain_16u.total() == 65536,
+              "16-bit tables have 65536 entries");
+    else
+        check(!ws.row_buffer.empty(), "float images use the row buffer");
+
+    check(cv::norm(out, fsiv_cbg_process(in, 1.3, -0.3, 2.0, true),
+                   cv::NORM_INF) == 0.0,
+          "workspace overload gives the same result as the returning overload");
+}
+
+int main()
+{
+    int retCode = EXIT_SUCCESS;
+    try
+    {
+        test_matches_reference();
+        test_high_bit_depths();
+        test_fast_gamma();
+        test_workspace_does_not_allocate(
+            CV_8U, "8-bit workspace and output buffers keep their address across calls");
+        test_workspace_does_not_allocate(
+            CV_16U, "16-bit workspace and output buffers keep their address across calls");
+        test_workspace_does_not_allocate(
+            CV_32F, "float workspace and output buffers keep their address across calls");
+        if (failures > 0)
+        {
+            std::cerr << failures << " checks failed." << std::endl;
+            retCode = EXIT_FAILURE;
+        }
+    }
+    catch (std::exception &e)
+    {
+        std::cerr << "Exception: " << e.what() << std::endl;
+        retCode = EXIT_FAILURE;
+    }
+    return retCode;
+}
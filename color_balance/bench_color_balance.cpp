@@ -0,0 +1,202 @@
+/*!
+  Benchmark of the color rescaling kernels.
+
+  Compares cv::multiply with the per channel LUT and the Q16 fixed point
+  kernels at several image sizes and reports which one is the fastest at
+  each size, and times fsiv_color_rescaling, which uses the Q16 kernel
+  fitted to be exact.
+
+  The local balance is timed at 1080p and 4K to check that it runs in real
+  time. It also measures the accuracy versus speed of the subsampled illuminant
+  estimation on the images of the data directory: for each stride, the time
+  of the estimate and the largest relative change of the gains with respect
+  to the full image estimate.
+*/
+
+#include <iostream>
+#include <exception>
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/core/utility.hpp>
+#include <opencv2/highgui/highgui.hpp>
+
+#include "common_code.hpp"
+
+const cv::String keys =
+    "{help h usage ? |      | print this message.}"
+    "{n iterations   |20    | iterations per measure.}"
+    "{d data         |../data| directory with the images of the stride benchmark.}";
+
+/**
+ * @brief Average time in milliseconds of a call to f.
+ */
+double time_ms(const std::function<void()> &f, int iterations)
+{
+    f(); // warm-up.
+    cv::TickMeter tm;
+    tm.start();
+    for (int i = 0; i < iterations; ++i)
+        f();
+    tm.stop();
+    return tm.getTimeMilli() / iterations;
+}
+
+/**
+ * @brief Largest relative change of the gains to/illuminant when the
+ * illuminant estimate changes from ref to est.
+ */
+double max_gain_error(const cv::Scalar &ref, const cv::Scalar &est)
+{
+    double err = 0.0;
+    for (int c = 0; c < 3; ++c)
+        err = std::max(err, std::abs(ref[c] / std::max(est[c], 1.0e-9) - 1.0));
+    return err;
+}
+
+/**
+ * @brief Report time and gain error of the illuminant estimate of an image
+ * for several strides, including the automatic one.
+ */
+void bench_strides(const cv::Mat &img, float p, int iterations)
+{
+    auto estimate = [&](int stride)
+    {
+        return p < 100.0f ? fsiv_estimate_white_patch_illuminant(img, p, stride)
+                          : fsiv_estimate_gray_world_illuminant(img, stride);
+    };
+    cv::Scalar ref, est;
+    const double ref_ms = time_ms([&]()
+                                  { ref = estimate(1); },
+                                  iterations);
+    std::cout << "  " << (p < 100.0f ? "white patch" : "gray world")
+              << ", stride 1: " << ref_ms << " ms" << std::endl;
+    const int strides[] = {2, 4, 8, 16, FSIV_AUTO_STRIDE};
+    for (size_t i = 0; i < sizeof(strides) / sizeof(strides[0]); ++i)
+    {
+        const double ms = time_ms([&]()
+                                  { est = estimate(strides[i]); },
+                                  iterations);
+        std::cout << "    stride ";
+        if (strides[i] == FSIV_AUTO_STRIDE)
+            std::cout << "auto";
+        else
+            std::cout << strides[i];
+        std::cout << ": " << ms << " ms, speedup " << ref_ms / ms
+                  << "x, max gain error " << 100.0 * max_gain_error(ref, est)
+                  << "%" << std::endl;
+    }
+}
+
+int main(int argc, char *const *argv)
+{
+    int retCode = EXIT_SUCCESS;
+
+    try
+    {
+        cv::CommandLineParser parser(argc, argv, keys);
+        parser.about("Benchmark the color rescaling kernels.");
+        if (parser.has("help"))
+        {
+            parser.printMessage();
+            return EXIT_SUCCESS;
+        }
+        const int iterations = parser.get<int>("n");
+        const cv::String data_dir = parser.get<cv::String>("d");
+        if (!parser.check())
+        {
+            parser.printErrors();
+            return EXIT_FAILURE;
+        }
+
+        const cv::Scalar factor(1.21, 0.93, 1.47);
+        const std::vector<cv::Size> sizes = {cv::Size(320, 240), cv::Size(640, 480),
+                                             cv::Size(1920, 1080), cv::Size(3840, 2160),
+                                             cv::Size(6000, 4000)};
+        const char *names[] = {"cv::multiply", "LUT", "Q16 fixed point"};
+        for (size_t s = 0; s < sizes.size(); ++s)
+        {
+            cv::Mat in(sizes[s], CV_8UC3), ref, out;
+            cv::randu(in, cv::Scalar::all(0), cv::Scalar::all(256));
+            cv::multiply(in, factor, ref);
+
+            double ms[3];
+            ms[0] = time_ms([&]()
+                            { cv::multiply(in, factor, out); },
+                            iterations);
+            ms[1] = time_ms([&]()
+                            { fsiv_scale_channels_lut(in, factor, out); },
+                            iterations);
+            const double lut_diff = cv::norm(ref, out, cv::NORM_INF);
+            ms[2] = time_ms([&]()
+                            { fsiv_scale_channels_fixed(in, factor, out); },
+                            iterations);
+            const double fixed_diff = cv::norm(ref, out, cv::NORM_INF);
+            // Factor 1.21/0.93/1.47 of the gray 100 mapped to 121/93/147.
+            const double rescaling_ms = time_ms([&]()
+                                                { out = fsiv_color_rescaling(in, cv::Scalar::all(100.0),
+                                                                             cv::Scalar(121.0, 93.0, 147.0)); },
+                                                iterations);
+            const double rescaling_diff = cv::norm(ref, out, cv::NORM_INF);
+
+            int best = 0;
+            std::cout << sizes[s].width << "x" << sizes[s].height << ":" << std::endl;
+            for (int k = 0; k < 3; ++k)
+            {
+                std::cout << "  " << names[k] << ": " << ms[k] << " ms, "
+                          << in.total() / (ms[k] * 1000.0) << " Mpixels/s"
+                          << std::endl;
+                if (ms[k] < ms[best])
+                    best = k;
+            }
+            std::cout << "  max abs diff: LUT " << lut_diff << ", Q16 "
+                      << fixed_diff << std::endl;
+            std::cout << "  fsiv_color_rescaling: " << rescaling_ms
+                      << " ms, max abs diff " << rescaling_diff << std::endl;
+            std::cout << "  fastest: " << names[best] << " ("
+                      << ms[0] / ms[best] << "x over cv::multiply)" << std::endl;
+        }
+
+        const cv::Size local_sizes[] = {cv::Size(1920, 1080), cv::Size(3840, 2160)};
+        for (int s = 0; s < 2; ++s)
+        {
+            cv::Mat in(local_sizes[s], CV_8UC3), out;
+            cv::randu(in, cv::Scalar::all(0), cv::Scalar::all(256));
+            for (int p = 5; p <= 100; p += 95)
+            {
+                const double ms = time_ms([&]()
+                                          { out = fsiv_local_color_balance(in, cv::Size(8, 8), p); },
+                                          iterations);
+                std::cout << "local balance 8x8 tiles, "
+                          << (p < 100 ? "white patch" : "gray world") << ", "
+                          << in.cols << "x" << in.rows << ": " << ms << " ms ("
+                          << 1000.0 / ms << " FPS)" << std::endl;
+            }
+        }
+
+        std::vector<cv::String> files;
+        cv::glob(data_dir + "/*.jpg", files);
+        if (files.empty())
+            std::cerr << "Warning: no images found in '" << data_dir
+                      << "', skipping the stride benchmark." << std::endl;
+        for (size_t f = 0; f < files.size(); ++f)
+        {
+            const cv::Mat img = cv::imread(files[f], cv::IMREAD_COLOR);
+            if (img.empty())
+                continue;
+            std::cout << files[f] << " (" << img.cols << "x" << img.rows
+                      << "):" << std::endl;
+            bench_strides(img, 100.0f, iterations);
+            bench_strides(img, 5.0f, iterations);
+        }
+    }
+    catch (std::exception &e)
+    {
+        std::cerr << "Exception: " << e.what() << std::endl;
+        retCode = EXIT_FAILURE;
+    }
+    return retCode;
+}
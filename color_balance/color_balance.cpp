@@ -1,17 +1,33 @@
 #include <iostream>
 #include <exception>
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <thread>
+#include <vector>
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/core/utility.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/videoio/videoio.hpp>
 
 #include "common_code.hpp"
+#include "bounded_queue.hpp"
 
 const cv::String keys =
     "{help h usage ? |      | print this message   }"
     "{i interactive  |      | use interactive mode.}"
     "{p              |0     | Percentage of brightest points used. Default 0 means use the classical white patch method. Values (0, 100) means to use this percentage of brighter pixels. Value 100 means use the gray world method.}"
+    "{t tiles        |0     | Use a local balance with a grid of t x t tiles. Default 0 means a global balance.}"
+    "{v video        |      | video mode: @input and @output are videos.}"
+    "{n every        |10    | video mode: estimate the illuminant every n frames.}"
+    "{a alpha        |0.2   | video mode: smoothing factor in (0, 1] of the gains moving average.}"
+    "{s stride       |4     | video mode: estimate the illuminant on a grid with this stride. Value 0 chooses it automatically.}"
+    "{batch          |      | batch mode: @input is a glob pattern or a manifest (.txt) with one image per line and @output a directory.}"
+    "{decoders       |1     | batch mode: decode threads.}"
+    "{workers        |0     | batch mode: color balance threads. Default 0 means one per CPU.}"
+    "{encoders       |1     | batch mode: encode threads.}"
     "{@input         |<none>| input image.}"
     "{@output        |<none>| output image.}";
 
@@ -24,8 +40,34 @@ struct UserData
 {
     cv::Mat in;  // input image.
     cv::Mat out; // output image.
+    int tiles;   // tiles per side of the local balance, 0 for a global one.
+    CumulativeHistogram hist; // cumulative histogram of the input image.
 };
 
+/**
+ * @brief Balance the input image with the current state.
+ *
+ * The global balance reads the illuminant from the cumulative histogram
+ * built once for the input image, so moving the trackbar only costs the
+ * rescaling of the image.
+ *
+ * @arg p is the percentage of brightest points used.
+ */
+void balance(UserData *user_data, int p)
+{
+    if (user_data->tiles > 0)
+    {
+        user_data->out = fsiv_local_color_balance(
+            user_data->in, cv::Size(user_data->tiles, user_data->tiles), p);
+    }
+    else
+    {
+        const cv::Scalar from = fsiv_estimate_illuminant_from_histogram(user_data->hist, p);
+        const cv::Scalar to = p < 100 ? cv::Scalar::all(255.0) : cv::Scalar::all(128.0);
+        user_data->out = fsiv_color_rescaling(user_data->in, from, to);
+    }
+}
+
 /** @brief Standard mouse callback
  * Use this function an argument for cv::setMouseCallback to control the
  * mouse interaction with a window.
@@ -59,13 +101,313 @@ void on_change(int v, void *user_data_)
 {
     UserData *user_data = static_cast<UserData *>(user_data_);
     std::cout << "Setting p to " << v << "%" << std::endl;
-    if (v < 100)
-        user_data->out = fsiv_white_patch_color_balance(user_data->in, v);
-    else
-        user_data->out = fsiv_gray_world_color_balance(user_data->in);
+    balance(user_data, v);
     cv::imshow("OUTPUT", user_data->out);
 }
 
+/**
+ * @brief Balance a whole video without GUI.
+ *
+ * The illuminant is estimated on a subsampled grid only every n frames and
+ * the gains are smoothed with an exponential moving average, so the balance
+ * does not flicker when the scene changes a little. Every frame is scaled
+ * with a LUT built from the cached gains, so the per frame cost is mostly
+ * that lookup.
+ *
+ * @arg p is the percentage of brightest points used, as in the image mode.
+ * @arg every is the number of frames between illuminant estimates.
+ * @arg alpha is the weight of a new estimate in the moving average.
+ * @arg stride is the stride of the estimation grid.
+ * @return the exit code of the program.
+ */
+int process_video(const cv::String &input_n, const cv::String &output_n,
+                  int p, int every, double alpha, int stride)
+{
+    cv::VideoCapture input(input_n);
+    if (!input.isOpened())
+    {
+        std::cerr << "Error: could not open input video." << std::endl;
+        return EXIT_FAILURE;
+    }
+    cv::Mat frame;
+    if (!input.read(frame) || frame.empty())
+    {
+        std::cerr << "Error: the input video has no frames." << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (frame.type() != CV_8UC3)
+    {
+        std::cerr << "Error: the input video is not a BGR video." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    double fps = input.get(cv::CAP_PROP_FPS);
+    if (fps <= 0.0)
+        fps = 25.0;
+    cv::VideoWriter output(output_n, static_cast<int>(input.get(cv::CAP_PROP_FOURCC)),
+                           fps, frame.size());
+    if (!output.isOpened())
+        output.open(output_n, cv::VideoWriter::fourcc('M', 'J', 'P', 'G'),
+                    fps, frame.size());
+    if (!output.isOpened())
+    {
+        std::cerr << "Error: could not create output video." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // Gray world moves the illuminant to mid gray and white patch to white.
+    const cv::Scalar to = p < 100 ? cv::Scalar::all(255.0) : cv::Scalar::all(128.0);
+    cv::Scalar gains;
+    cv::Mat lut, balanced(frame.size(), frame.type());
+    const double tick_ms = 1000.0 / cv::getTickFrequency();
+    double estimate_ms = 0.0, apply_ms = 0.0;
+    int frames = 0, estimates = 0;
+    const int64 start = cv::getTickCount();
+    do
+    {
+        if (frames % every == 0)
+        {
+            const int64 t0 = cv::getTickCount();
+            const cv::Scalar illuminant =
+                p < 100 ? fsiv_estimate_white_patch_illuminant(frame, p, stride)
+                        : fsiv_estimate_gray_world_illuminant(frame, stride);
+            fsiv_update_video_gains(illuminant, to, alpha, estimates == 0, gains);
+            lut = fsiv_create_scaling_lut(gains);
+            estimate_ms += (cv::getTickCount() - t0) * tick_ms;
+            ++estimates;
+        }
+        const int64 t0 = cv::getTickCount();
+        cv::LUT(frame, lut, balanced);
+        apply_ms += (cv::getTickCount() - t0) * tick_ms;
+        output.write(balanced);
+        ++frames;
+    } while (input.read(frame) && !frame.empty());
+    const double total_s = (cv::getTickCount() - start) * tick_ms / 1000.0;
+
+    std::cout << "Processed " << frames << " frames of " << balanced.cols
+              << "x" << balanced.rows << " in " << total_s << " s ("
+              << frames / total_s << " FPS with decode and encode)." << std::endl;
+    std::cout << "Illuminant estimates: " << estimates << ", mean "
+              << estimate_ms / estimates << " ms." << std::endl;
+    std::cout << "Apply step: mean " << apply_ms / frames << " ms per frame."
+              << std::endl;
+    std::cout << "Balance cost per frame (estimate + apply): "
+              << (estimate_ms + apply_ms) / frames << " ms." << std::endl;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief An image travelling through the batch pipeline.
+ */
+struct BatchItem
+{
+    cv::String name; // input file name.
+    cv::Mat image;   // decoded or balanced image.
+};
+
+/**
+ * @brief Time accounting of a stage of the batch pipeline.
+ */
+struct StageStats
+{
+    const char *name;
+    int threads;
+    std::atomic<int64> busy_ticks; // ticks spent working, not waiting on queues.
+    std::atomic<int> items;
+};
+
+/**
+ * @brief Run n threads of a pipeline stage. The last thread to finish
+ * closes the output queue so the next stage can drain it and finish.
+ */
+template <class Body>
+void start_stage(std::vector<std::thread> &threads, int n, Body body,
+                 BoundedQueue<BatchItem> *out)
+{
+    std::shared_ptr<std::atomic<int>> running = std::make_shared<std::atomic<int>>(n);
+    for (int i = 0; i < n; ++i)
+        threads.emplace_back([=]()
+                             {
+                                 body();
+                                 if (--*running == 0 && out)
+                                     out->close(); });
+}
+
+/**
+ * @brief Read the input file names of the batch mode.
+ *
+ * A pattern ending in ".txt" is a manifest with one file name per line, any
+ * other pattern is expanded with cv::glob.
+ */
+std::vector<cv::String> read_batch_inputs(const cv::String &pattern)
+{
+    std::vector<cv::String> files;
+    if (pattern.size() > 4 && pattern.substr(pattern.size() - 4) == ".txt")
+    {
+        std::ifstream manifest(pattern.c_str());
+        std::string line;
+        while (std::getline(manifest, line))
+        {
+            const size_t end = line.find_last_not_of(" \t\r");
+            if (end != std::string::npos)
+                files.push_back(line.substr(0, end + 1));
+        }
+    }
+    else
+        cv::glob(pattern, files);
+    return files;
+}
+
+/**
+ * @brief Balance a batch of images with a decode, balance and encode
+ * pipeline.
+ *
+ * Each stage runs its own threads and the stages are connected by bounded
+ * queues, so decoded images cannot pile up in memory. At the end the
+ * utilization of each stage, the fraction of its thread time spent working
+ * instead of waiting on the queues, shows which stage is the bottleneck.
+ *
+ * @arg p is the percentage of brightest points used, as in the image mode.
+ * @arg tiles is the number of tiles per side of a local balance, or 0.
+ * @return the exit code of the program.
+ */
+int process_batch(const cv::String &pattern, const cv::String &output_dir,
+                  int p, int tiles, int decoders, int workers, int encoders)
+{
+    const std::vector<cv::String> files = read_batch_inputs(pattern);
+    if (files.empty())
+    {
+        std::cerr << "Error: no input images found in '" << pattern << "'." << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (workers <= 0)
+        workers = cv::getNumberOfCPUs();
+
+    // Parallelism is across images, so avoid nesting OpenCV's own threads.
+    cv::setNumThreads(1);
+
+    BoundedQueue<BatchItem> decoded(2 * workers);
+    BoundedQueue<BatchItem> balanced(2 * encoders);
+    StageStats stats[3] = {{"decode", decoders, {0}, {0}},
+                           {"balance", workers, {0}, {0}},
+                           {"encode", encoders, {0}, {0}}};
+    std::atomic<size_t> next_file(0);
+    std::atomic<int> failed(0);
+    std::atomic<int64> pixels(0);
+
+    auto decode_stage = [&]()
+    {
+        for (size_t i = next_file++; i < files.size(); i = next_file++)
+        {
+            const int64 t0 = cv::getTickCount();
+            BatchItem item;
+            item.name = files[i];
+            try
+            {
+                item.image = cv::imread(item.name, cv::IMREAD_COLOR);
+            }
+            catch (std::exception &e)
+            {
+                std::cerr << "Error: could not decode input image '" << item.name
+                          << "': " << e.what() << std::endl;
+                item.image.release();
+            }
+            stats[0].busy_ticks += cv::getTickCount() - t0;
+            if (item.image.empty())
+            {
+                std::cerr << "Error: could not open input image '" << item.name << "'." << std::endl;
+                ++failed;
+                continue;
+            }
+            ++stats[0].items;
+            decoded.push(std::move(item));
+        }
+    };
+    auto balance_stage = [&]()
+    {
+        BatchItem item;
+        while (decoded.pop(item))
+        {
+            // A failed item must not leave the thread: the queues would never
+            // be drained and the other stages would block forever.
+            const int64 t0 = cv::getTickCount();
+            try
+            {
+                if (tiles > 0)
+                    item.image = fsiv_local_color_balance(item.image, cv::Size(tiles, tiles), p);
+                else if (p < 100)
+                    item.image = fsiv_white_patch_color_balance(item.image, p);
+                else
+                    item.image = fsiv_gray_world_color_balance(item.image);
+            }
+            catch (std::exception &e)
+            {
+                stats[1].busy_ticks += cv::getTickCount() - t0;
+                std::cerr << "Error: could not balance input image '" << item.name
+                          << "': " << e.what() << std::endl;
+                ++failed;
+                continue;
+            }
+            pixels += static_cast<int64>(item.image.total());
+            stats[1].busy_ticks += cv::getTickCount() - t0;
+            ++stats[1].items;
+            balanced.push(std::move(item));
+        }
+    };
+    auto encode_stage = [&]()
+    {
+        BatchItem item;
+        while (balanced.pop(item))
+        {
+            const int64 t0 = cv::getTickCount();
+            const size_t slash = item.name.find_last_of("/\\");
+            const cv::String output_name = output_dir + "/" +
+                                           item.name.substr(slash == cv::String::npos ? 0 : slash + 1);
+            bool ok = false;
+            try
+            {
+                ok = cv::imwrite(output_name, item.image);
+            }
+            catch (std::exception &e)
+            {
+                std::cerr << "Error: " << e.what() << std::endl;
+            }
+            stats[2].busy_ticks += cv::getTickCount() - t0;
+            if (!ok)
+            {
+                std::cerr << "Error: could not save output image '" << output_name << "'." << std::endl;
+                ++failed;
+                continue;
+            }
+            ++stats[2].items;
+        }
+    };
+
+    const int64 start = cv::getTickCount();
+    std::vector<std::thread> threads;
+    start_stage(threads, decoders, decode_stage, &decoded);
+    start_stage(threads, workers, balance_stage, &balanced);
+    start_stage(threads, encoders, encode_stage, static_cast<BoundedQueue<BatchItem> *>(nullptr));
+    for (size_t i = 0; i < threads.size(); ++i)
+        threads[i].join();
+    const double total_s = (cv::getTickCount() - start) / cv::getTickFrequency();
+
+    std::cout << "Balanced " << stats[2].items << " images (" << failed
+              << " failed) in " << total_s << " s: " << stats[2].items / total_s
+              << " images/s, " << pixels / total_s / 1.0e6 << " Mpixels/s."
+              << std::endl;
+    for (int s = 0; s < 3; ++s)
+    {
+        const double busy_s = stats[s].busy_ticks / cv::getTickFrequency();
+        std::cout << "  " << stats[s].name << ": " << stats[s].threads
+                  << " threads, " << stats[s].items << " images, utilization "
+                  << 100.0 * busy_s / (total_s * stats[s].threads) << "%, "
+                  << 1000.0 * busy_s / std::max(1, static_cast<int>(stats[s].items))
+                  << " ms per image." << std::endl;
+    }
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
 int main(int argc, char *const *argv)
 {
     int retCode = EXIT_SUCCESS;
@@ -94,7 +436,43 @@ int main(int argc, char *const *argv)
             parser.printErrors();
             return EXIT_FAILURE;
         }
+        if (parser.has("video"))
+        {
+            if (parser.get<int>("t") != 0)
+            {
+                std::cerr << "Error: t can not be used with video mode." << std::endl;
+                return EXIT_FAILURE;
+            }
+            const int every = parser.get<int>("n");
+            const double alpha = parser.get<double>("a");
+            const int stride = parser.get<int>("s");
+            if (every < 1 || stride < 0 || alpha <= 0.0 || alpha > 1.0)
+            {
+                std::cerr << "Error: video mode needs n>=1, s>=0 and alpha in (0, 1]." << std::endl;
+                return EXIT_FAILURE;
+            }
+            return process_video(input_n, output_n, p, every, alpha, stride);
+        }
         UserData user_data;
+        user_data.tiles = parser.get<int>("t");
+        if (user_data.tiles < 0)
+        {
+            std::cerr << "Error: t must be >= 0." << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (parser.has("batch"))
+        {
+            const int decoders = parser.get<int>("decoders");
+            const int workers = parser.get<int>("workers");
+            const int encoders = parser.get<int>("encoders");
+            if (decoders < 1 || workers < 0 || encoders < 1)
+            {
+                std::cerr << "Error: batch mode needs decoders>=1, workers>=0 and encoders>=1." << std::endl;
+                return EXIT_FAILURE;
+            }
+            return process_batch(input_n, output_n, p, user_data.tiles,
+                                 decoders, workers, encoders);
+        }
         user_data.in = cv::imread(input_n, cv::IMREAD_COLOR);
         if (user_data.in.empty())
         {
@@ -102,10 +480,9 @@ int main(int argc, char *const *argv)
             return EXIT_FAILURE;
         }
 
-        if (p < 100)
-            user_data.out = fsiv_white_patch_color_balance(user_data.in, p);
-        else
-            user_data.out = fsiv_gray_world_color_balance(user_data.in);
+        if (user_data.tiles == 0)
+            fsiv_compute_cumulative_histogram(user_data.in, user_data.hist);
+        balance(&user_data, p);
 
         cv::namedWindow("INPUT");
         cv::namedWindow("OUTPUT");
@@ -1,6 +1,174 @@
 #include "common_code.hpp"
 #include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/core/hal/intrin.hpp>
 #include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+namespace
+{
+
+// Fixed point luminance weights used by cv::cvtColor(COLOR_BGR2GRAY) with
+// 8-bit images, so the single pass histogram gives the same bins as
+// fsiv_convert_bgr_to_gray.
+const int GRAY_SHIFT = 14;
+const int GRAY_B = 1868;
+const int GRAY_G = 9617;
+const int GRAY_R = 4899;
+
+inline int
+bgr_to_gray(const uchar *bgr)
+{
+    return (bgr[0] * GRAY_B + bgr[1] * GRAY_G + bgr[2] * GRAY_R +
+            (1 << (GRAY_SHIFT - 1))) >> GRAY_SHIFT;
+}
+
+// Fraction bits of the fixed point factors of fsiv_scale_channels_fixed.
+const int SCALE_SHIFT = 16;
+
+// Scale a row of n BGR pixels by the Q16 factors k: each sample is
+// (v * k + bias) >> 16, saturated.
+void
+scale_row_fixed(const uchar *src, uchar *dst, int n, const unsigned k[3],
+                const unsigned bias[3])
+{
+    int x = 0;
+#if CV_SIMD128
+    const cv::v_uint32x4 v_k[3] = {cv::v_setall_u32(k[0]), cv::v_setall_u32(k[1]),
+                                   cv::v_setall_u32(k[2])};
+    const cv::v_uint32x4 v_bias[3] = {cv::v_setall_u32(bias[0]), cv::v_setall_u32(bias[1]),
+                                      cv::v_setall_u32(bias[2])};
+    for (; x <= n - 16; x += 16)
+    {
+        cv::v_uint8x16 c[3];
+        cv::v_load_deinterleave(src + 3 * x, c[0], c[1], c[2]);
+        for (int i = 0; i < 3; ++i)
+        {
+            cv::v_uint16x8 w0, w1;
+            cv::v_uint32x4 d0, d1, d2, d3;
+            cv::v_expand(c[i], w0, w1);
+            cv::v_expand(w0, d0, d1);
+            cv::v_expand(w1, d2, d3);
+            d0 = (d0 * v_k[i] + v_bias[i]) >> SCALE_SHIFT;
+            d1 = (d1 * v_k[i] + v_bias[i]) >> SCALE_SHIFT;
+            d2 = (d2 * v_k[i] + v_bias[i]) >> SCALE_SHIFT;
+            d3 = (d3 * v_k[i] + v_bias[i]) >> SCALE_SHIFT;
+            c[i] = cv::v_pack(cv::v_pack(d0, d1), cv::v_pack(d2, d3));
+        }
+        cv::v_store_interleave(dst + 3 * x, c[0], c[1], c[2]);
+    }
+#endif
+    for (; x < n; ++x)
+        for (int i = 0; i < 3; ++i)
+        {
+            const unsigned v = (src[3 * x + i] * k[i] + bias[i]) >> SCALE_SHIFT;
+            dst[3 * x + i] = static_cast<uchar>(std::min(v, 255u));
+        }
+}
+
+// Scale a BGR image by the Q16 factors k and biases, in parallel by rows.
+void
+scale_image_fixed(const cv::Mat &in, const unsigned k[3], const unsigned bias[3],
+                  cv::Mat &out)
+{
+    out.create(in.rows, in.cols, in.type());
+    cv::parallel_for_(cv::Range(0, in.rows), [&](const cv::Range &rows)
+    {
+        for (int y = rows.start; y < rows.end; ++y)
+            scale_row_fixed(in.ptr<uchar>(y), out.ptr<uchar>(y), in.cols, k, bias);
+    });
+}
+
+// Q16 factor of a scaling factor, clamped to [0, 256], which does not change
+// the saturated result and keeps v * k in 32 bits.
+inline unsigned
+fixed_factor(double factor)
+{
+    const double f = std::min(std::max(factor, 0.0), 256.0);
+    return static_cast<unsigned>(cvRound(f * (1 << SCALE_SHIFT)));
+}
+
+// Find, for each channel, the Q16 factor k next to the rounded one and the
+// bias with which scale_row_fixed gives exactly the entries of the scaling
+// LUT. Every level v bounds the bias from below by lut[v] * 2^16 - v * k and,
+// unless it saturates, from above by (lut[v] + 1) * 2^16 - v * k. There is
+// no solution when the rounding ties of the LUT do not lie on such a line,
+// e.g. factor 1.5 with round half to even.
+bool
+fit_fixed_to_lut(const cv::Mat &lut, const cv::Scalar &factor, unsigned k[3],
+                 unsigned bias[3])
+{
+    const uchar *table = lut.ptr<uchar>();
+    const int64 one = int64(1) << SCALE_SHIFT;
+    for (int c = 0; c < 3; ++c)
+    {
+        const int64 k0 = fixed_factor(factor[c]);
+        const int deltas[] = {0, 1, -1, 2, -2};
+        bool found = false;
+        for (int d = 0; d < 5 && !found; ++d)
+        {
+            const int64 kc = k0 + deltas[d];
+            int64 lo = 0, hi = std::numeric_limits<int64>::max();
+            for (int v = 0; v < 256; ++v)
+            {
+                const int64 r = table[3 * v + c];
+                lo = std::max(lo, r * one - v * kc);
+                if (r < 255)
+                    hi = std::min(hi, (r + 1) * one - v * kc);
+            }
+            if (kc >= 0 && lo < hi &&
+                255 * kc + lo <= std::numeric_limits<unsigned>::max())
+            {
+                k[c] = static_cast<unsigned>(kc);
+                bias[c] = static_cast<unsigned>(lo);
+                found = true;
+            }
+        }
+        if (!found)
+            return false;
+    }
+    return true;
+}
+
+// Store dst[i] = saturate(src[i] * gains[i]) for a row of n samples.
+void
+scale_row_by_gains(const uchar *src, const float *gains, uchar *dst, int n)
+{
+    int i = 0;
+#if CV_SIMD128
+    for (; i <= n - 16; i += 16)
+    {
+        cv::v_uint16x8 w0, w1;
+        cv::v_uint32x4 d0, d1, d2, d3;
+        cv::v_expand(cv::v_load(src + i), w0, w1);
+        cv::v_expand(w0, d0, d1);
+        cv::v_expand(w1, d2, d3);
+        const cv::v_int32x4 r0 = cv::v_round(cv::v_cvt_f32(cv::v_reinterpret_as_s32(d0)) * cv::v_load(gains + i));
+        const cv::v_int32x4 r1 = cv::v_round(cv::v_cvt_f32(cv::v_reinterpret_as_s32(d1)) * cv::v_load(gains + i + 4));
+        const cv::v_int32x4 r2 = cv::v_round(cv::v_cvt_f32(cv::v_reinterpret_as_s32(d2)) * cv::v_load(gains + i + 8));
+        const cv::v_int32x4 r3 = cv::v_round(cv::v_cvt_f32(cv::v_reinterpret_as_s32(d3)) * cv::v_load(gains + i + 12));
+        cv::v_store(dst + i, cv::v_pack_u(cv::v_pack(r0, r1), cv::v_pack(r2, r3)));
+    }
+#endif
+    for (; i < n; ++i)
+        dst[i] = cv::saturate_cast<uchar>(src[i] * gains[i]);
+}
+
+// Position of pixel i between the centers of n tiles covering len pixels:
+// the first tile t0, the next one t1 and the weight w of t1.
+void
+tile_interpolation(int i, int len, int n, int &t0, int &t1, float &w)
+{
+    const float u = std::min(std::max((i + 0.5f) * n / len - 0.5f, 0.0f),
+                             static_cast<float>(n - 1));
+    t0 = std::min(static_cast<int>(u), n - 1);
+    t1 = std::min(t0 + 1, n - 1);
+    w = u - t0;
+}
+
+} // namespace
 
 cv::Mat fsiv_color_rescaling(const cv::Mat &in, const cv::Scalar &from, const cv::Scalar &to)
 {
@@ -13,7 +181,16 @@ cv::Mat fsiv_color_rescaling(const cv::Mat &in, const cv::Scalar &from, const cv
     cv::Scalar scaling_factor;
     cv::divide(to, from, scaling_factor);
 
-    cv::multiply(in, scaling_factor, out);
+    // Same values as cv::multiply(in, scaling_factor, out). The Q16 kernel is
+    // the fastest at every size of bench_color_balance, so it is used with a
+    // factor and bias fitted to the scaling LUT, which makes it exact. The
+    // LUT itself is only used when no exact fit exists.
+    const cv::Mat lut = fsiv_create_scaling_lut(scaling_factor);
+    unsigned k[3], bias[3];
+    if (fit_fixed_to_lut(lut, scaling_factor, k, bias))
+        scale_image_fixed(in, k, bias, out);
+    else
+        cv::LUT(in, lut, out);
 
     //
     CV_Assert(out.type() == in.type());
@@ -21,7 +198,234 @@ cv::Mat fsiv_color_rescaling(const cv::Mat &in, const cv::Scalar &from, const cv
     return out;
 }
 
-cv::Mat fsiv_gray_world_color_balance(cv::Mat const &in)
+cv::Mat fsiv_create_scaling_lut(const cv::Scalar &factor)
+{
+    cv::Mat levels(1, 256, CV_8UC3);
+    for (int v = 0; v < 256; ++v)
+        levels.at<cv::Vec3b>(v) = cv::Vec3b(v, v, v);
+    cv::Mat lut;
+    cv::multiply(levels, factor, lut);
+
+    CV_Assert(lut.type() == CV_8UC3 && lut.total() == 256);
+    return lut;
+}
+
+void fsiv_scale_channels_lut(const cv::Mat &in, const cv::Scalar &factor,
+                             cv::Mat &out)
+{
+    CV_Assert(in.type() == CV_8UC3);
+    cv::LUT(in, fsiv_create_scaling_lut(factor), out);
+    CV_Assert(out.type() == in.type() && out.size() == in.size());
+}
+
+void fsiv_scale_channels_fixed(const cv::Mat &in, const cv::Scalar &factor,
+                               cv::Mat &out)
+{
+    CV_Assert(in.type() == CV_8UC3);
+    const unsigned round = 1u << (SCALE_SHIFT - 1);
+    const unsigned k[3] = {fixed_factor(factor[0]), fixed_factor(factor[1]),
+                           fixed_factor(factor[2])};
+    const unsigned bias[3] = {round, round, round};
+    scale_image_fixed(in, k, bias, out);
+    CV_Assert(out.type() == in.type() && out.size() == in.size());
+}
+
+void fsiv_update_video_gains(const cv::Scalar &illuminant, const cv::Scalar &to,
+                             double alpha, bool first, cv::Scalar &gains)
+{
+    CV_Assert(alpha > 0.0 && alpha <= 1.0);
+    cv::Scalar new_gains;
+    for (int c = 0; c < 3; ++c)
+        new_gains[c] = illuminant[c] > 0.0 ? to[c] / illuminant[c] : 1.0;
+    gains = first ? new_gains : alpha * new_gains + (1.0 - alpha) * gains;
+}
+
+namespace
+{
+
+// Gray world illuminant estimated on the grid of pixels whose row and column
+// are multiples of stride.
+cv::Scalar
+gray_world_on_grid(cv::Mat const &in, int stride)
+{
+    if (stride == 1)
+        return cv::mean(in, cv::noArray());
+
+    int64 sum[3] = {0, 0, 0};
+    int64 count = 0;
+    for (int y = 0; y < in.rows; y += stride)
+    {
+        const uchar *row = in.ptr<uchar>(y);
+        for (int x = 0; x < in.cols; x += stride)
+        {
+            const uchar *src = row + 3 * x;
+            sum[0] += src[0];
+            sum[1] += src[1];
+            sum[2] += src[2];
+        }
+        count += (in.cols + stride - 1) / stride;
+    }
+    return cv::Scalar(static_cast<double>(sum[0]) / count,
+                      static_cast<double>(sum[1]) / count,
+                      static_cast<double>(sum[2]) / count);
+}
+
+// White patch illuminant estimated on the grid of pixels whose row and column
+// are multiples of stride.
+cv::Scalar
+white_patch_on_grid(cv::Mat const &in, float p, int stride)
+{
+
+    if (p == 0.0f)
+    {
+        cv::Point max_point;
+        if (stride == 1)
+        {
+            cv::Mat gray;
+            fsiv_convert_bgr_to_gray(in, gray);
+            cv::minMaxLoc(gray, nullptr, nullptr, nullptr, &max_point);
+        }
+        else
+        {
+            // First brightest pixel of the grid, as cv::minMaxLoc does.
+            int max_gray = -1;
+            for (int y = 0; y < in.rows; y += stride)
+            {
+                const uchar *row = in.ptr<uchar>(y);
+                for (int x = 0; x < in.cols; x += stride)
+                {
+                    const int g = bgr_to_gray(row + 3 * x);
+                    if (g > max_gray)
+                    {
+                        max_gray = g;
+                        max_point = cv::Point(x, y);
+                    }
+                }
+            }
+        }
+        return in.at<cv::Vec3b>(max_point);
+    }
+
+    // A single pass gives both the luminance histogram and the color sums of
+    // each luminance bin, so the mean of the brighter pixels is read from the
+    // bins instead of building a gray image and a mask.
+    cv::Mat hist, bin_sums;
+    fsiv_compute_luma_histogram(in, hist, bin_sums, stride);
+    const float p_value = fsiv_compute_histogram_percentile(hist, 1 - p / 100.0);
+    return fsiv_compute_bright_mean(bin_sums, static_cast<int>(p_value));
+}
+
+// Smallest number of grid samples used as the start of the automatic stride.
+const int AUTO_MIN_SAMPLES = 4096;
+
+// Estimate the illuminant with estimate(stride) starting on a coarse grid and
+// halving the stride until the estimate changes less than tolerance, relative
+// to each channel, between two consecutive strides.
+template <typename Estimator>
+cv::Scalar
+estimate_auto(cv::Mat const &in, double tolerance, const Estimator &estimate)
+{
+    int stride = 1;
+    while ((in.rows / (2 * stride)) * (in.cols / (2 * stride)) >= AUTO_MIN_SAMPLES)
+        stride *= 2;
+    cv::Scalar coarse = estimate(stride);
+    while (stride > 1)
+    {
+        stride /= 2;
+        const cv::Scalar fine = estimate(stride);
+        bool converged = true;
+        for (int c = 0; c < 3; ++c)
+            converged = converged &&
+                        std::abs(fine[c] - coarse[c]) <= tolerance * std::max(fine[c], 1.0);
+        if (converged)
+            return fine;
+        coarse = fine;
+    }
+    return coarse;
+}
+
+} // namespace
+
+cv::Scalar fsiv_estimate_gray_world_illuminant(cv::Mat const &in, int stride,
+                                               double tolerance)
+{
+    CV_Assert(in.type() == CV_8UC3);
+    CV_Assert(stride >= 1 || stride == FSIV_AUTO_STRIDE);
+    if (stride == FSIV_AUTO_STRIDE)
+        return estimate_auto(in, tolerance, [&](int s)
+                             { return gray_world_on_grid(in, s); });
+    return gray_world_on_grid(in, stride);
+}
+
+cv::Scalar fsiv_estimate_white_patch_illuminant(cv::Mat const &in, float p,
+                                                int stride, double tolerance)
+{
+    CV_Assert(in.type() == CV_8UC3);
+    CV_Assert(0.0f <= p && p <= 100.0f);
+    CV_Assert(stride >= 1 || stride == FSIV_AUTO_STRIDE);
+    if (stride == FSIV_AUTO_STRIDE)
+        return estimate_auto(in, tolerance, [&](int s)
+                             { return white_patch_on_grid(in, p, s); });
+    return white_patch_on_grid(in, p, stride);
+}
+
+void fsiv_compute_cumulative_histogram(cv::Mat const &in, CumulativeHistogram &ch)
+{
+    CV_Assert(in.type() == CV_8UC3);
+    cv::Mat hist, bin_sums;
+    fsiv_compute_luma_histogram(in, hist, bin_sums);
+
+    ch.cdf.create(256, 1, CV_64FC1);
+    ch.bright_sums.create(256, 1, CV_64FC4);
+    double count = 0.0;
+    for (int v = 0; v < 256; ++v)
+    {
+        count += bin_sums.at<cv::Vec4d>(v)[3];
+        ch.cdf.at<double>(v) = count;
+    }
+    cv::Vec4d sums(0.0, 0.0, 0.0, 0.0);
+    for (int v = 255; v >= 0; --v)
+    {
+        sums += bin_sums.at<cv::Vec4d>(v);
+        ch.bright_sums.at<cv::Vec4d>(v) = sums;
+    }
+    ch.brightest = white_patch_on_grid(in, 0.0f, 1);
+}
+
+int fsiv_cumulative_histogram_percentile(CumulativeHistogram const &ch,
+                                         float p_value)
+{
+    CV_Assert(ch.cdf.type() == CV_64FC1 && ch.cdf.total() == 256);
+    CV_Assert(0.0 <= p_value && p_value <= 1.0);
+
+    // The threshold is computed in float as fsiv_compute_histogram_percentile
+    // does, so both give the same index.
+    const double *cdf = ch.cdf.ptr<double>();
+    const float target = p_value * static_cast<float>(cdf[255]);
+    const int p = static_cast<int>(std::lower_bound(cdf, cdf + 255, target) - cdf);
+
+    CV_Assert(0 <= p && p < 256);
+    return p;
+}
+
+cv::Scalar fsiv_estimate_illuminant_from_histogram(CumulativeHistogram const &ch,
+                                                   float p)
+{
+    CV_Assert(0.0f <= p && p <= 100.0f);
+    if (p == 0.0f)
+        return ch.brightest;
+    const int first_bin = p < 100.0f
+                              ? fsiv_cumulative_histogram_percentile(ch, 1 - p / 100.0)
+                              : 0;
+    const cv::Vec4d sums = ch.bright_sums.at<cv::Vec4d>(first_bin);
+    if (sums[3] == 0.0)
+        return cv::Scalar::all(0.0);
+    const double scale = 1.0 / sums[3];
+    return cv::Scalar(sums[0] * scale, sums[1] * scale, sums[2] * scale);
+}
+
+cv::Mat fsiv_gray_world_color_balance(cv::Mat const &in, int stride,
+                                      double tolerance)
 {
     CV_Assert(in.type() == CV_8UC3);
     cv::Mat out;
@@ -29,7 +433,7 @@ cv::Mat fsiv_gray_world_color_balance(cv::Mat const &in)
     //  HINT: use cv::mean to compute the mean pixel value.
 
     cv::Scalar mean;
-    mean = cv::mean(in, cv::noArray());
+    mean = fsiv_estimate_gray_world_illuminant(in, stride, tolerance);
 
     out = fsiv_color_rescaling(in, mean, cv::Scalar(128, 128, 128));
 
@@ -73,6 +477,75 @@ cv::Mat fsiv_compute_image_histogram(cv::Mat const &img)
     return hist;
 }
 
+void fsiv_compute_luma_histogram(const cv::Mat &in, cv::Mat &hist,
+                                 cv::Mat &bin_sums, int stride)
+{
+    CV_Assert(in.type() == CV_8UC3);
+    CV_Assert(stride >= 1);
+
+    // Each stripe of sampled rows accumulates into its own row of partial
+    // sums and the rows are added at the end, so no locking is needed and the
+    // result does not depend on the number of threads.
+    const int n_rows = (in.rows + stride - 1) / stride;
+    const int n_stripes = std::max(1, std::min(n_rows, 4 * cv::getNumThreads()));
+    cv::Mat partial(n_stripes, 256, CV_64FC4);
+    cv::parallel_for_(cv::Range(0, n_stripes), [&](const cv::Range &stripes)
+    {
+        for (int s = stripes.start; s < stripes.end; ++s)
+        {
+            int64 acc[256][4] = {};
+            const int r_end = (s + 1) * n_rows / n_stripes;
+            for (int r = s * n_rows / n_stripes; r < r_end; ++r)
+            {
+                const uchar *row = in.ptr<uchar>(r * stride);
+                for (int x = 0; x < in.cols; x += stride)
+                {
+                    const uchar *src = row + 3 * x;
+                    int64 *bin = acc[bgr_to_gray(src)];
+                    bin[0] += src[0];
+                    bin[1] += src[1];
+                    bin[2] += src[2];
+                    ++bin[3];
+                }
+            }
+            cv::Vec4d *dst = partial.ptr<cv::Vec4d>(s);
+            for (int v = 0; v < 256; ++v)
+                dst[v] = cv::Vec4d(acc[v][0], acc[v][1], acc[v][2], acc[v][3]);
+        }
+    }, n_stripes);
+
+    hist.create(256, 1, CV_32FC1);
+    bin_sums.create(256, 1, CV_64FC4);
+    for (int v = 0; v < 256; ++v)
+    {
+        cv::Vec4d total(0.0, 0.0, 0.0, 0.0);
+        for (int s = 0; s < n_stripes; ++s)
+            total += partial.at<cv::Vec4d>(s, v);
+        bin_sums.at<cv::Vec4d>(v) = total;
+        hist.at<float>(v) = static_cast<float>(total[3]);
+    }
+
+    CV_Assert(hist.type() == CV_32FC1 && hist.rows == 256 && hist.cols == 1);
+    CV_Assert(bin_sums.type() == CV_64FC4 && bin_sums.rows == 256);
+}
+
+cv::Scalar fsiv_compute_bright_mean(const cv::Mat &bin_sums, int first_bin)
+{
+    CV_Assert(bin_sums.type() == CV_64FC4);
+    CV_Assert(0 <= first_bin && first_bin < bin_sums.rows);
+
+    // Suffix sum of the bins, read in 256 steps instead of masking the image.
+    cv::Vec4d total(0.0, 0.0, 0.0, 0.0);
+    for (int v = first_bin; v < bin_sums.rows; ++v)
+        total += bin_sums.at<cv::Vec4d>(v);
+    if (total[3] == 0.0)
+        return cv::Scalar::all(0.0);
+    // Multiply by the inverse of the count as cv::mean does, so both give
+    // the same value.
+    const double scale = 1.0 / total[3];
+    return cv::Scalar(total[0] * scale, total[1] * scale, total[2] * scale);
+}
+
 float fsiv_compute_histogram_percentile(cv::Mat const &hist, float p_value)
 {
     CV_Assert(hist.type() == CV_32FC1);
@@ -101,18 +574,16 @@ float fsiv_compute_histogram_percentile(cv::Mat const &hist, float p_value)
     return p;
 }
 
-cv::Mat fsiv_white_patch_color_balance(cv::Mat const &in, float p)
+cv::Mat fsiv_white_patch_color_balance(cv::Mat const &in, float p,
+                                       int stride, double tolerance)
 {
     CV_Assert(in.type() == CV_8UC3);
     CV_Assert(0.0f <= p && p <= 100.0f);
     cv::Mat out;
 
     cv::Point max_point;
-    cv::Mat hist;
-    cv::Mat gray;
-    float p_value;
 
-    if (p == 0.0)
+    if (p == 0.0 && stride == 1)
     {
         // TODO
         // HINT: convert to GRAY color space to get the illuminance.
@@ -138,12 +609,8 @@ cv::Mat fsiv_white_patch_color_balance(cv::Mat const &in, float p)
         //        to compute the mean value.
         // HINT: use fsiv_color_rescaling when the "from" scalar was computed.
 
-        fsiv_convert_bgr_to_gray(in, gray);
-        hist = fsiv_compute_image_histogram(gray);
-        p_value = fsiv_compute_histogram_percentile(hist, 1 - p / 100.0);
-
-        cv::Mat mask = gray >= p_value;
-        cv::Scalar from = cv::mean(in, mask);
+        cv::Scalar from = fsiv_estimate_white_patch_illuminant(in, p, stride,
+                                                               tolerance);
         cv::Scalar to = cv::Scalar(255, 255, 255);
 
         out = fsiv_color_rescaling(in, from, to);
@@ -155,3 +622,86 @@ cv::Mat fsiv_white_patch_color_balance(cv::Mat const &in, float p)
     CV_Assert(out.rows == in.rows && out.cols == in.cols);
     return out;
 }
+
+cv::Mat fsiv_compute_tile_gains(cv::Mat const &in, cv::Size tiles, float p)
+{
+    CV_Assert(in.type() == CV_8UC3);
+    CV_Assert(0.0f <= p && p <= 100.0f);
+    CV_Assert(tiles.width >= 1 && tiles.height >= 1);
+    CV_Assert(tiles.width <= in.cols && tiles.height <= in.rows);
+
+    cv::Mat gains(tiles, CV_32FC3);
+    const cv::Scalar to = p < 100.0f ? cv::Scalar::all(255.0) : cv::Scalar::all(128.0);
+    cv::parallel_for_(cv::Range(0, static_cast<int>(tiles.area())), [&](const cv::Range &range)
+    {
+        for (int t = range.start; t < range.end; ++t)
+        {
+            const int tx = t % tiles.width, ty = t / tiles.width;
+            const int x0 = tx * in.cols / tiles.width, x1 = (tx + 1) * in.cols / tiles.width;
+            const int y0 = ty * in.rows / tiles.height, y1 = (ty + 1) * in.rows / tiles.height;
+            const cv::Mat tile = in(cv::Range(y0, y1), cv::Range(x0, x1));
+            const cv::Scalar illuminant =
+                p < 100.0f ? fsiv_estimate_white_patch_illuminant(tile, p)
+                           : fsiv_estimate_gray_world_illuminant(tile);
+            // A channel without light, e.g. an all black tile, has no
+            // illuminant to correct: a neutral gain keeps it from darkening
+            // the neighbour tiles through the interpolation.
+            cv::Vec3f &g = gains.at<cv::Vec3f>(ty, tx);
+            for (int c = 0; c < 3; ++c)
+                g[c] = illuminant[c] > 0.0 ? static_cast<float>(to[c] / illuminant[c]) : 1.0f;
+        }
+    });
+
+    CV_Assert(gains.type() == CV_32FC3 && gains.size() == tiles);
+    return gains;
+}
+
+cv::Mat fsiv_apply_tile_gains(cv::Mat const &in, cv::Mat const &gains)
+{
+    CV_Assert(in.type() == CV_8UC3);
+    CV_Assert(gains.type() == CV_32FC3 && !gains.empty());
+    cv::Mat out(in.rows, in.cols, in.type());
+
+    // The horizontal position of each column between tile centers is the
+    // same for all the rows.
+    const int nx = gains.cols, ny = gains.rows;
+    std::vector<int> tx0(in.cols), tx1(in.cols);
+    std::vector<float> wx(in.cols);
+    for (int x = 0; x < in.cols; ++x)
+        tile_interpolation(x, in.cols, nx, tx0[x], tx1[x], wx[x]);
+
+    cv::parallel_for_(cv::Range(0, in.rows), [&](const cv::Range &rows)
+    {
+        std::vector<float> row_gains(3 * nx), line(3 * in.cols);
+        for (int y = rows.start; y < rows.end; ++y)
+        {
+            // Interpolate vertically the gains of each tile column, then
+            // horizontally the gain of each pixel, and scale the row while
+            // the line of gains is still in cache.
+            int ty0, ty1;
+            float wy;
+            tile_interpolation(y, in.rows, ny, ty0, ty1, wy);
+            const float *g0 = gains.ptr<float>(ty0);
+            const float *g1 = gains.ptr<float>(ty1);
+            for (int i = 0; i < 3 * nx; ++i)
+                row_gains[i] = g0[i] + wy * (g1[i] - g0[i]);
+            for (int x = 0; x < in.cols; ++x)
+            {
+                const float *a = &row_gains[3 * tx0[x]];
+                const float *b = &row_gains[3 * tx1[x]];
+                for (int c = 0; c < 3; ++c)
+                    line[3 * x + c] = a[c] + wx[x] * (b[c] - a[c]);
+            }
+            scale_row_by_gains(in.ptr<uchar>(y), line.data(), out.ptr<uchar>(y),
+                               3 * in.cols);
+        }
+    });
+
+    CV_Assert(out.type() == in.type() && out.size() == in.size());
+    return out;
+}
+
+cv::Mat fsiv_local_color_balance(cv::Mat const &in, cv::Size tiles, float p)
+{
+    return fsiv_apply_tile_gains(in, fsiv_compute_tile_gains(in, tiles, p));
+}
@@ -3,6 +3,12 @@
 
 /**
  * @brief Scale the color of an image so an input color is transformed into an output color.
+ *
+ * The result is the same as cv::multiply(in, to/from). It is computed with
+ * the Q16 fixed point kernel, the fastest one at every size measured by
+ * bench_color_balance, with the factor and rounding bias fitted to the
+ * scaling LUT so the result is exact, or with the LUT when no fit exists.
+ *
  * @param in is the image to be rescaled.
  * @param from is the input color.
  * @param to is the output color.
@@ -13,6 +19,68 @@
 cv::Mat fsiv_color_rescaling(const cv::Mat &in, const cv::Scalar &from,
                              const cv::Scalar &to);
 
+/**
+ * @brief Build the per channel table that scales each level by a factor.
+ *
+ * Entry v of channel c is saturate(v * factor[c]), computed with
+ * cv::multiply so the table gives the same values as scaling the image with
+ * cv::multiply.
+ *
+ * @param factor is the scaling factor of each channel.
+ * @return a 1x256 CV_8UC3 table to be used with cv::LUT.
+ */
+cv::Mat fsiv_create_scaling_lut(const cv::Scalar &factor);
+
+/**
+ * @brief Scale each channel of an image by a factor using a per channel LUT.
+ *
+ * The result is the same as cv::multiply(in, factor, out) but each sample
+ * costs only a table lookup. out may be the same image as in.
+ *
+ * @param in is the image to be scaled.
+ * @param factor is the scaling factor of each channel.
+ * @param out is the scaled image.
+ * @pre in.type()==CV_8UC3
+ */
+void fsiv_scale_channels_lut(const cv::Mat &in, const cv::Scalar &factor,
+                             cv::Mat &out);
+
+/**
+ * @brief Scale each channel of an image by a factor in Q16 fixed point.
+ *
+ * Each factor is rounded to a multiple of 1/65536 and each sample is
+ * computed as (v * round(factor * 65536) + 32768) >> 16 with saturation,
+ * vectorized with OpenCV universal intrinsics and in parallel across rows.
+ * Factors are clamped to [0, 256], which does not change the result. The
+ * fixed point error is below 0.004 levels, so a sample can only differ by
+ * one level from cv::multiply when v * factor is that close to a half.
+ * out may be the same image as in.
+ *
+ * @param in is the image to be scaled.
+ * @param factor is the scaling factor of each channel.
+ * @param out is the scaled image.
+ * @pre in.type()==CV_8UC3
+ */
+void fsiv_scale_channels_fixed(const cv::Mat &in, const cv::Scalar &factor,
+                               cv::Mat &out);
+
+/**
+ * @brief Update the smoothed gains of a video balance with a new estimate.
+ *
+ * The gains of the estimate are to/illuminant, but a channel whose
+ * illuminant is zero, as in a black frame or a fade from black, gets gain 1,
+ * so no infinite or NaN gain enters the moving average.
+ *
+ * @param illuminant is the illuminant estimated on the current frame.
+ * @param to is the color the illuminant is moved to.
+ * @param alpha is the weight of the new estimate in the moving average.
+ * @param first is true for the first estimate, which replaces gains.
+ * @param gains are the smoothed gains, updated in place.
+ * @pre 0<alpha && alpha<=1
+ */
+void fsiv_update_video_gains(const cv::Scalar &illuminant, const cv::Scalar &to,
+                             double alpha, bool first, cv::Scalar &gains);
+
 /**
  * @brief Convert a BGR color image to Gray scale.
  * @param img is the input image.
@@ -45,21 +113,213 @@ cv::Mat fsiv_compute_image_histogram(cv::Mat const &img);
  */
 float fsiv_compute_histogram_percentile(cv::Mat const &hist, float p_value);
 
+/**
+ * @brief Compute in a single pass the luminance histogram of a BGR image and
+ * the BGR sums of the pixels in each luminance bin.
+ *
+ * The luminance is the one given by fsiv_convert_bgr_to_gray, so hist is
+ * equal to the fsiv_compute_image_histogram of the gray image. With bin_sums
+ * the mean color of the pixels in any luminance range can be computed
+ * without a gray image or a mask.
+ *
+ * @param[in] in is the input image.
+ * @param[out] hist is the luminance histogram.
+ * @param[out] bin_sums has, for each luminance bin, the sum of the B, G and R
+ * values of its pixels and the number of pixels.
+ * @param[in] stride only the pixels whose row and column are multiples of
+ * stride are used. Value 1 uses all the pixels.
+ * @pre in.type()==CV_8UC3
+ * @pre stride>=1
+ * @post hist.type()==CV_32FC1 && hist.rows==256 && hist.cols==1
+ * @post bin_sums.type()==CV_64FC4 && bin_sums.rows==256 && bin_sums.cols==1
+ * @warning A BGR color space is assumed for the input image.
+ */
+void fsiv_compute_luma_histogram(const cv::Mat &in, cv::Mat &hist,
+                                 cv::Mat &bin_sums, int stride = 1);
+
+/**
+ * @brief Compute the mean color of the pixels with luminance >= first_bin.
+ * @param bin_sums are the per bin sums given by fsiv_compute_luma_histogram.
+ * @param first_bin is the first luminance bin used.
+ * @return the mean BGR color, or zero if no pixel is in the range.
+ * @pre bin_sums.type()==CV_64FC4
+ * @pre 0<=first_bin && first_bin<bin_sums.rows
+ */
+cv::Scalar fsiv_compute_bright_mean(const cv::Mat &bin_sums, int first_bin);
+
+/**
+ * @brief Stride value that selects the estimation grid automatically.
+ *
+ * The estimate starts on a coarse grid of a few thousand pixels and the
+ * stride is halved until the estimate changes less than a relative
+ * tolerance between two consecutive strides.
+ */
+const int FSIV_AUTO_STRIDE = 0;
+
+/**
+ * @brief Estimate the illuminant color of an image with the "gray world"
+ * assumption.
+ *
+ * With stride>1 only a regular grid of pixels is visited. On large photos
+ * this gives the same gains within a fraction of a percent at a fraction of
+ * the cost.
+ *
+ * @param[in] in is the input image.
+ * @param[in] stride only the pixels whose row and column are multiples of
+ * stride are used. Value 1 uses all the pixels and FSIV_AUTO_STRIDE chooses
+ * the stride automatically.
+ * @param[in] tolerance is the relative change per channel accepted by the
+ * automatic stride.
+ * @return the mean BGR color of the used pixels.
+ * @pre in.type()==CV_8UC3
+ * @pre stride>=1 || stride==FSIV_AUTO_STRIDE
+ */
+cv::Scalar fsiv_estimate_gray_world_illuminant(cv::Mat const &in, int stride = 1,
+                                               double tolerance = 0.005);
+
+/**
+ * @brief Estimate the illuminant color of an image with the "white patch"
+ * assumption.
+ * @param[in] in is the input image.
+ * @param[in] p use this percentage of brighter pixels. Value p=0 means use the most brighter.
+ * @param[in] stride only the pixels whose row and column are multiples of
+ * stride are used. Value 1 uses all the pixels and FSIV_AUTO_STRIDE chooses
+ * the stride automatically.
+ * @param[in] tolerance is the relative change per channel accepted by the
+ * automatic stride.
+ * @return the color of the brightest pixel, or the mean color of the p%
+ * brighter pixels.
+ * @pre in.type()==CV_8UC3
+ * @pre 0<=p && p<=100
+ * @pre stride>=1 || stride==FSIV_AUTO_STRIDE
+ */
+cv::Scalar fsiv_estimate_white_patch_illuminant(cv::Mat const &in, float p,
+                                                int stride = 1,
+                                                double tolerance = 0.005);
+
+/**
+ * @brief Cumulative luminance histogram of an image.
+ *
+ * It is built once per image and then answers any percentile query by a
+ * binary search and gives the mean color of the brighter pixels in constant
+ * time, so sweeping p does not visit the image again.
+ */
+struct CumulativeHistogram
+{
+    cv::Mat cdf;          // 256x1 CV_64FC1, number of pixels with luminance <= v.
+    cv::Mat bright_sums;  // 256x1 CV_64FC4, B, G, R sums and number of pixels with luminance >= v.
+    cv::Scalar brightest; // color of the brightest pixel.
+};
+
+/**
+ * @brief Build the cumulative luminance histogram of an image.
+ * @param[in] in is the input image.
+ * @param[out] ch is the cumulative histogram. Its memory is reused.
+ * @pre in.type()==CV_8UC3
+ * @warning A BGR color space is assumed for the input image.
+ */
+void fsiv_compute_cumulative_histogram(cv::Mat const &in, CumulativeHistogram &ch);
+
+/**
+ * @brief Compute the percentile index given a p_value with a binary search.
+ *
+ * It gives the same index as fsiv_compute_histogram_percentile on the
+ * histogram of the image, in O(log bins).
+ *
+ * @param ch is the cumulative histogram.
+ * @param p_value the p_value.
+ * @return the percentile index.
+ * @pre 0<=p_value && p_value<=1.0
+ * @post 0<=ret_v && ret_v<256
+ */
+int fsiv_cumulative_histogram_percentile(CumulativeHistogram const &ch,
+                                         float p_value);
+
+/**
+ * @brief Estimate the illuminant color from a cumulative histogram.
+ * @param ch is the cumulative histogram of the image.
+ * @param p use this percentage of brighter pixels. Value p=0 means use the
+ * most brighter and value 100 means use the gray world method.
+ * @return the same illuminant as fsiv_estimate_white_patch_illuminant, or as
+ * fsiv_estimate_gray_world_illuminant when p=100.
+ * @pre 0<=p && p<=100
+ */
+cv::Scalar fsiv_estimate_illuminant_from_histogram(CumulativeHistogram const &ch,
+                                                   float p);
+
 /**
  * @brief Apply a "gray world" color balance operation to the image.
  * @param[in] in is the input image.
+ * @param[in] stride is the stride of the grid used to estimate the
+ * illuminant. See fsiv_estimate_gray_world_illuminant.
+ * @param[in] tolerance is the tolerance of the automatic stride.
  * @return the color balanced image.
  * @pre in.type()==CV_8UC3
  * @warning A BGR color space is assumed for the input image.
  */
-cv::Mat fsiv_gray_world_color_balance(cv::Mat const &in);
+cv::Mat fsiv_gray_world_color_balance(cv::Mat const &in, int stride = 1,
+                                      double tolerance = 0.005);
 
 /**
  * @brief Apply a "white patch" color balance operation to the image.
  * @param[in] in is the input image.
  * @param[in] p use this percentage of brighter pixels. Value p=0 means use the most brighter.
+ * @param[in] stride is the stride of the grid used to estimate the
+ * illuminant. See fsiv_estimate_white_patch_illuminant.
+ * @param[in] tolerance is the tolerance of the automatic stride.
+ * @return the color balanced image.
+ * @pre in.type()==CV_8UC3
+ * @warning A BGR color space is assumed for the input image.
+ */
+cv::Mat fsiv_white_patch_color_balance(cv::Mat const &in, float p,
+                                       int stride = 1, double tolerance = 0.005);
+
+/**
+ * @brief Estimate the color balance gains of each tile of an image.
+ *
+ * The image is split into a grid of tiles and the illuminant of each tile is
+ * estimated in parallel with the "gray world" (p=100) or the "white patch"
+ * (p<100) assumption.
+ *
+ * @param[in] in is the input image.
+ * @param[in] tiles is the number of tiles in each direction.
+ * @param[in] p use this percentage of brighter pixels. Value 100 means use the gray world method.
+ * @return the per tile gains to/illuminant, with one element per tile. A
+ * channel whose illuminant is zero, as in an all black tile, gets gain 1.
+ * @pre in.type()==CV_8UC3
+ * @pre 0<=p && p<=100
+ * @pre 1<=tiles.width<=in.cols && 1<=tiles.height<=in.rows
+ * @post ret_v.type()==CV_32FC3 && ret_v.size()==tiles
+ */
+cv::Mat fsiv_compute_tile_gains(cv::Mat const &in, cv::Size tiles, float p);
+
+/**
+ * @brief Scale an image by per tile gains interpolated between tile centers.
+ *
+ * As in CLAHE, the gain of each pixel is interpolated bilinearly between the
+ * gains of the four nearest tile centers, and it is clamped at the image
+ * borders. The interpolation and the scaling are fused in a single parallel
+ * pass over the rows.
+ *
+ * @param[in] in is the input image.
+ * @param[in] gains are the per tile gains given by fsiv_compute_tile_gains.
+ * @return the scaled image.
+ * @pre in.type()==CV_8UC3
+ * @pre gains.type()==CV_32FC3
+ */
+cv::Mat fsiv_apply_tile_gains(cv::Mat const &in, cv::Mat const &gains);
+
+/**
+ * @brief Apply a spatially varying color balance to the image.
+ *
+ * It is fsiv_apply_tile_gains with the gains of fsiv_compute_tile_gains, so
+ * regions lit by different illuminants get different white points.
+ *
+ * @param[in] in is the input image.
+ * @param[in] tiles is the number of tiles in each direction.
+ * @param[in] p use this percentage of brighter pixels. Value 100 means use the gray world method.
  * @return the color balanced image.
  * @pre in.type()==CV_8UC3
  * @warning A BGR color space is assumed for the input image.
  */
-cv::Mat fsiv_white_patch_color_balance(cv::Mat const &in, float p);
+cv::Mat fsiv_local_color_balance(cv::Mat const &in, cv::Size tiles, float p);
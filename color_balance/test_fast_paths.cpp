@@ -0,0 +1,284 @@
+/*!
+  Test of the fast paths of the color balance functions.
+
+  Checks that the single pass engines give the same results as the original
+  implementations built from several full passes of OpenCV functions.
+*/
+
+#include <iostream>
+#include <exception>
+#include <cmath>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/core/utility.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "common_code.hpp"
+
+static int failures = 0;
+
+static void check(bool condition, const char *what)
+{
+    std::cout << (condition ? "[OK]   " : "[FAIL] ") << what << std::endl;
+    if (!condition)
+        ++failures;
+}
+
+/**
+ * @brief Original white patch mean: gray image, histogram, mask and
+ * cv::mean, used as reference.
+ */
+static cv::Scalar reference_bright_mean(const cv::Mat &in, float p)
+{
+    cv::Mat gray;
+    fsiv_convert_bgr_to_gray(in, gray);
+    const cv::Mat hist = fsiv_compute_image_histogram(gray);
+    const float p_value = fsiv_compute_histogram_percentile(hist, 1 - p / 100.0);
+    const cv::Mat mask = gray >= p_value;
+    return cv::mean(in, mask);
+}
+
+static void test_luma_histogram()
+{
+    cv::Mat in(173, 211, CV_8UC3);
+    cv::randu(in, cv::Scalar::all(0), cv::Scalar::all(256));
+
+    cv::Mat gray, hist, bin_sums;
+    fsiv_convert_bgr_to_gray(in, gray);
+    fsiv_compute_luma_histogram(in, hist, bin_sums);
+    check(cv::norm(hist, fsiv_compute_image_histogram(gray), cv::NORM_INF) == 0.0,
+          "single pass histogram matches the gray image histogram");
+    check(bin_sums.type() == CV_64FC4 && cv::sum(bin_sums)[3] == in.total(),
+          "bin sums count every pixel once");
+
+    const float ps[] = {1.0f, 5.0f, 20.0f, 50.0f, 99.0f};
+    bool same_mean = true;
+    for (size_t i = 0; i < sizeof(ps) / sizeof(ps[0]); ++i)
+    {
+        const float p_value = fsiv_compute_histogram_percentile(hist, 1 - ps[i] / 100.0);
+        const cv::Scalar mean = fsiv_compute_bright_mean(bin_sums, static_cast<int>(p_value));
+        same_mean = same_mean &&
+                    cv::norm(mean - reference_bright_mean(in, ps[i])) <= 1.0e-9;
+    }
+    check(same_mean, "bright mean from the bin sums matches the masked mean");
+}
+
+static void test_scaling_kernels()
+{
+    // Odd width so the scalar tail of the vectorized kernel is also used.
+    cv::Mat in(61, 203, CV_8UC3);
+    cv::randu(in, cv::Scalar::all(0), cv::Scalar::all(256));
+    const cv::Scalar factors[] = {cv::Scalar(1.0, 1.0, 1.0),
+                                  cv::Scalar(1.3, 0.7, 2.5),
+                                  cv::Scalar(0.01, 255.0 / 37.0, 300.0)};
+    bool lut_exact = true, fixed_close = true;
+    for (size_t i = 0; i < sizeof(factors) / sizeof(factors[0]); ++i)
+    {
+        cv::Mat expected, lut_out, fixed_out;
+        cv::multiply(in, factors[i], expected);
+        fsiv_scale_channels_lut(in, factors[i], lut_out);
+        fsiv_scale_channels_fixed(in, factors[i], fixed_out);
+        lut_exact = lut_exact && cv::norm(lut_out, expected, cv::NORM_INF) == 0.0;
+        fixed_close = fixed_close && fixed_out.type() == CV_8UC3 &&
+                      cv::norm(fixed_out, expected, cv::NORM_INF) <= 1.0;
+    }
+    check(lut_exact, "LUT scaling matches cv::multiply");
+    check(fixed_close, "Q16 scaling is within one level of cv::multiply");
+
+    cv::Mat same = in.clone();
+    fsiv_scale_channels_fixed(same, factors[1], same);
+    cv::Mat expected;
+    fsiv_scale_channels_fixed(in, factors[1], expected);
+    check(cv::norm(same, expected, cv::NORM_INF) == 0.0,
+          "Q16 scaling can work in place");
+
+    // Factors with a Q16 fit and 1.5, whose rounding ties to even have none.
+    const cv::Scalar from(100.0, 37.0, 200.0);
+    const cv::Scalar tos[] = {cv::Scalar(121.0, 93.0, 147.0),
+                              cv::Scalar(150.0, 255.0, 255.0),
+                              cv::Scalar(0.0, 37.0, 33.0)};
+    bool rescaling_exact = true;
+    for (size_t i = 0; i < sizeof(tos) / sizeof(tos[0]); ++i)
+    {
+        cv::Scalar factor;
+        cv::divide(tos[i], from, factor);
+        cv::Mat reference;
+        cv::multiply(in, factor, reference);
+        rescaling_exact = rescaling_exact &&
+                          cv::norm(fsiv_color_rescaling(in, from, tos[i]),
+                                   reference, cv::NORM_INF) == 0.0;
+    }
+    check(rescaling_exact, "color rescaling matches cv::multiply");
+}
+
+static void test_illuminant_estimation()
+{
+    cv::Mat in(600, 800, CV_8UC3);
+    cv::randu(in, cv::Scalar(20, 40, 60), cv::Scalar(180, 200, 250));
+    check(cv::norm(fsiv_estimate_gray_world_illuminant(in) - cv::mean(in)) == 0.0,
+          "gray world estimate with stride 1 is the image mean");
+    check(cv::norm(fsiv_estimate_white_patch_illuminant(in, 10.0f) -
+                   reference_bright_mean(in, 10.0f)) <= 1.0e-9,
+          "white patch estimate with stride 1 matches the masked mean");
+
+    // A uniform image has the same estimate on any grid.
+    const cv::Mat flat(151, 187, CV_8UC3, cv::Scalar(70, 110, 190));
+    bool same = true;
+    for (int stride = 2; stride <= 8; stride *= 2)
+        same = same &&
+               cv::norm(fsiv_estimate_gray_world_illuminant(flat, stride) -
+                        cv::Scalar(70, 110, 190)) < 1.0e-9 &&
+               cv::norm(fsiv_estimate_white_patch_illuminant(flat, 5.0f, stride) -
+                        cv::Scalar(70, 110, 190)) < 1.0e-9 &&
+               cv::norm(fsiv_estimate_white_patch_illuminant(flat, 0.0f, stride) -
+                        cv::Scalar(70, 110, 190)) < 1.0e-9;
+    check(same, "strided estimates of a uniform image are exact");
+
+    // On a noisy image the grid estimate is close to the full estimate.
+    const cv::Scalar full = fsiv_estimate_gray_world_illuminant(in);
+    const cv::Scalar grid = fsiv_estimate_gray_world_illuminant(in, 4);
+    check(cv::norm(full - grid, cv::NORM_INF) < 2.0,
+          "strided gray world estimate is close to the full one");
+
+    // The automatic stride stops when two consecutive grids agree, so its
+    // estimate is close to the full one, and exact for a uniform image.
+    check(cv::norm(fsiv_estimate_gray_world_illuminant(in, FSIV_AUTO_STRIDE, 0.005) -
+                   full, cv::NORM_INF) < 0.02 * 255.0 &&
+              cv::norm(fsiv_estimate_white_patch_illuminant(flat, 5.0f, FSIV_AUTO_STRIDE) -
+                       cv::Scalar(70, 110, 190)) < 1.0e-9,
+          "automatic stride estimate is close to the full one");
+    check(cv::norm(fsiv_gray_world_color_balance(in, 4),
+                   fsiv_gray_world_color_balance(in), cv::NORM_INF) <= 3.0,
+          "gray world balance with stride 4 is close to the full one");
+}
+
+static void test_local_balance()
+{
+    cv::Mat in(240, 320, CV_8UC3);
+    cv::randu(in, cv::Scalar::all(40), cv::Scalar::all(200));
+
+    // With one tile the gain is the same everywhere.
+    check(cv::norm(fsiv_local_color_balance(in, cv::Size(1, 1), 100.0f),
+                   fsiv_gray_world_color_balance(in), cv::NORM_INF) <= 1.0,
+          "local balance with one tile matches the global gray world");
+
+    // Two halves lit by different illuminants are both made neutral.
+    cv::Mat mixed = in.clone();
+    cv::multiply(mixed.colRange(0, 160), cv::Scalar(1.2, 1.0, 0.6),
+                 mixed.colRange(0, 160));
+    cv::multiply(mixed.colRange(160, 320), cv::Scalar(0.6, 0.9, 1.25),
+                 mixed.colRange(160, 320));
+    const cv::Mat gains = fsiv_compute_tile_gains(mixed, cv::Size(4, 2), 100.0f);
+    check(gains.type() == CV_32FC3 && gains.size() == cv::Size(4, 2),
+          "tile gains have one element per tile");
+    const cv::Mat out = fsiv_local_color_balance(mixed, cv::Size(4, 2), 100.0f);
+    const cv::Scalar left = cv::mean(out(cv::Rect(0, 0, 80, 240)));
+    const cv::Scalar right = cv::mean(out(cv::Rect(240, 0, 80, 240)));
+    check(std::abs(left[0] - left[2]) < 3.0 && std::abs(right[0] - right[2]) < 3.0,
+          "local balance neutralizes regions with different illuminants");
+
+    // A black tile keeps a neutral gain instead of darkening its neighbours.
+    cv::Mat dark = in.clone();
+    dark(cv::Rect(0, 0, 80, 120)).setTo(cv::Scalar::all(0));
+    const cv::Mat dark_gains = fsiv_compute_tile_gains(dark, cv::Size(4, 2), 100.0f);
+    const cv::Vec3f black_gain = dark_gains.at<cv::Vec3f>(0, 0);
+    check(black_gain[0] == 1.0f && black_gain[1] == 1.0f && black_gain[2] == 1.0f,
+          "black tile gets a neutral gain");
+}
+
+static void test_video_gains()
+{
+    // A black frame, as at the start of a fade in, and then normal frames.
+    cv::Mat frame(120, 160, CV_8UC3, cv::Scalar::all(0));
+    const cv::Scalar to = cv::Scalar::all(128.0);
+    cv::Scalar gains;
+    fsiv_update_video_gains(fsiv_estimate_gray_world_illuminant(frame), to,
+                            0.2, true, gains);
+    check(gains[0] == 1.0 && gains[1] == 1.0 && gains[2] == 1.0,
+          "black frame gives neutral video gains");
+
+    cv::randu(frame, cv::Scalar(20, 40, 60), cv::Scalar(100, 120, 140));
+    const cv::Scalar illuminant = fsiv_estimate_gray_world_illuminant(frame);
+    for (int i = 0; i < 100; ++i)
+        fsiv_update_video_gains(illuminant, to, 0.2, false, gains);
+    bool converged = true;
+    for (int c = 0; c < 3; ++c)
+        converged = converged && std::isfinite(gains[c]) &&
+                    std::abs(gains[c] - to[c] / illuminant[c]) < 1.0e-6;
+    check(converged, "video gains recover from a black frame");
+}
+
+static void test_cumulative_histogram()
+{
+    cv::Mat in(130, 170, CV_8UC3);
+    cv::randu(in, cv::Scalar::all(0), cv::Scalar::all(256));
+    cv::Mat gray;
+    fsiv_convert_bgr_to_gray(in, gray);
+    const cv::Mat hist = fsiv_compute_image_histogram(gray);
+    CumulativeHistogram ch;
+    fsiv_compute_cumulative_histogram(in, ch);
+
+    bool same_index = true;
+    for (int i = 0; i <= 100; ++i)
+    {
+        const float p_value = i / 100.0f;
+        same_index = same_index &&
+                     fsiv_cumulative_histogram_percentile(ch, p_value) ==
+                         fsiv_compute_histogram_percentile(hist, p_value);
+    }
+    check(same_index, "binary search percentile matches the linear search");
+
+    bool same_illuminant = true;
+    for (int p = 0; p <= 100; p += 5)
+    {
+        const cv::Scalar expected =
+            p < 100 ? fsiv_estimate_white_patch_illuminant(in, p)
+                    : fsiv_estimate_gray_world_illuminant(in);
+        same_illuminant = same_illuminant &&
+                          cv::norm(fsiv_estimate_illuminant_from_histogram(ch, p) -
+                                   expected) == 0.0;
+    }
+    check(same_illuminant, "illuminant from the cumulative histogram matches the image estimate");
+}
+
+static void test_white_patch()
+{
+    cv::Mat in(120, 160, CV_8UC3);
+    cv::randu(in, cv::Scalar(10, 20, 30), cv::Scalar(200, 230, 250));
+    const float ps[] = {2.0f, 10.0f, 60.0f};
+    bool same = true;
+    for (size_t i = 0; i < sizeof(ps) / sizeof(ps[0]); ++i)
+    {
+        const cv::Mat expected = fsiv_color_rescaling(
+            in, reference_bright_mean(in, ps[i]), cv::Scalar::all(255));
+        same = same && cv::norm(fsiv_white_patch_color_balance(in, ps[i]),
+                                expected, cv::NORM_INF) == 0.0;
+    }
+    check(same, "white patch matches the mask based implementation");
+}
+
+int main()
+{
+    int retCode = EXIT_SUCCESS;
+    try
+    {
+        test_luma_histogram();
+        test_scaling_kernels();
+        test_illuminant_estimation();
+        test_local_balance();
+        test_video_gains();
+        test_cumulative_histogram();
+        test_white_patch();
+        if (failures > 0)
+        {
+            std::cerr << failures << " checks failed." << std::endl;
+            retCode = EXIT_FAILURE;
+        }
+    }
+    catch (std::exception &e)
+    {
+        std::cerr << "Exception: " << e.what() << std::endl;
+        retCode = EXIT_FAILURE;
+    }
+    return retCode;
+}
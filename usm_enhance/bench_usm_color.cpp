@@ -0,0 +1,113 @@
+/*!
+  Benchmark of the unsharp mask enhance of color images.
+
+  Compares the original pipeline of usm_enhance, which converts the image to
+  float and to HSV, sharpens V and converts back to 8-bit BGR, with the 8-bit
+  YCrCb luma engine fsiv_usm_enhance_bgr at several image sizes and radii.
+  Both pipelines start and end with a 8-bit BGR image.
+*/
+
+#include <iostream>
+#include <exception>
+#include <functional>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/core/utility.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "common_code.hpp"
+
+const cv::String keys =
+    "{help h usage ? |      | print this message.}"
+    "{n iterations   |10    | iterations per measure.}"
+    "{g gain         |1.0   | Enhance's gain.}"
+    "{f filter       |1     | Filter type: 0->Box, 1->Gaussian.}";
+
+/**
+ * @brief Average time in milliseconds of a call to f.
+ */
+double time_ms(const std::function<void()> &f, int iterations)
+{
+    f(); // warm-up.
+    cv::TickMeter tm;
+    tm.start();
+    for (int i = 0; i < iterations; ++i)
+        f();
+    tm.stop();
+    return tm.getTimeMilli() / iterations;
+}
+
+/**
+ * @brief Original pipeline: float conversion, HSV, enhance V and back.
+ */
+cv::Mat hsv_usm_enhance(cv::Mat const &in, double g, int r, int filter_type)
+{
+    cv::Mat in_f, hsv, out_f, out;
+    std::vector<cv::Mat> channels;
+    in.convertTo(in_f, CV_32F, 1.0 / 255.0);
+    cv::cvtColor(in_f, hsv, cv::COLOR_BGR2HSV);
+    cv::split(hsv, channels);
+    channels[2] = fsiv_usm_enhance(channels[2], g, r, filter_type);
+    cv::merge(channels, hsv);
+    cv::cvtColor(hsv, out_f, cv::COLOR_HSV2BGR);
+    out_f.convertTo(out, CV_8U, 255.0);
+    return out;
+}
+
+int main(int argc, char *const *argv)
+{
+    int retCode = EXIT_SUCCESS;
+
+    try
+    {
+        cv::CommandLineParser parser(argc, argv, keys);
+        parser.about("Benchmark the unsharp mask enhance of color images.");
+        if (parser.has("help"))
+        {
+            parser.printMessage();
+            return EXIT_SUCCESS;
+        }
+        const int iterations = parser.get<int>("n");
+        const double g = parser.get<double>("g");
+        const int filter_type = parser.get<int>("f");
+        if (!parser.check())
+        {
+            parser.printErrors();
+            return EXIT_FAILURE;
+        }
+
+        const cv::Size sizes[] = {cv::Size(640, 480), cv::Size(1920, 1080),
+                                  cv::Size(3840, 2160)};
+        const int radii[] = {2, 8};
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+        {
+            cv::Mat in(sizes[s], CV_8UC3), ref, out;
+            cv::randu(in, cv::Scalar::all(0), cv::Scalar::all(256));
+            cv::GaussianBlur(in, in, cv::Size(0, 0), 2.0);
+            std::cout << sizes[s].width << "x" << sizes[s].height << ":" << std::endl;
+            for (size_t i = 0; i < sizeof(radii) / sizeof(radii[0]); ++i)
+            {
+                const int r = radii[i];
+                const double hsv_ms = time_ms([&]()
+                                              { ref = hsv_usm_enhance(in, g, r, filter_type); },
+                                              iterations);
+                const double luma_ms = time_ms([&]()
+                                               { out = fsiv_usm_enhance_bgr(in, g, r, filter_type); },
+                                               iterations);
+                cv::Mat diff;
+                cv::absdiff(ref, out, diff);
+                std::cout << "  r=" << r << ": HSV " << hsv_ms << " ms, YCrCb luma "
+                          << luma_ms << " ms, speedup " << hsv_ms / luma_ms
+                          << "x, mean abs diff " << cv::mean(diff.reshape(1))[0]
+                          << std::endl;
+            }
+        }
+    }
+    catch (std::exception &e)
+    {
+        std::cerr << "Exception: " << e.what() << std::endl;
+        retCode = EXIT_FAILURE;
+    }
+    return retCode;
+}
@@ -0,0 +1,329 @@
+/*!
+  Benchmark of the unsharp mask filtering engines.
+
+  Compares the original correlation, which takes a ROI and allocates a
+  product image for every output pixel, with the direct correlation engine
+  of fsiv_filter2D for several radii, and checks that both give the same
+  result.
+
+  Then it times the direct, separable and DFT backends of the Gaussian blur
+  for several radii, fits the constants of the cost model used to choose the
+  backend automatically, prints them as the -k option of usm_enhance and
+  reports which backend is chosen and which one was the fastest for each
+  radius.
+
+  Finally it compares the blur of an expanded copy of the image with the
+  virtual border engines, which do not allocate the expanded copy, and the
+  multi-scale enhance on a decimated Gaussian pyramid against separate
+  unsharp masks for each scale. It also measures the unsharp combine fused
+  in the blur engines against a blur followed by fsiv_combine_images, and
+  the adaptive enhance against the plain enhance followed by a median
+  denoise.
+*/
+
+#include <iostream>
+#include <exception>
+#include <functional>
+#include <cmath>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/core/utility.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "common_code.hpp"
+
+const cv::String keys =
+    "{help h usage ? |      | print this message.}"
+    "{n iterations   |5     | iterations per measure.}"
+    "{max_direct_r   |8     | largest radius timed with the direct backend.}";
+
+/**
+ * @brief Average time in milliseconds of a call to f.
+ */
+double time_ms(const std::function<void()> &f, int iterations)
+{
+    f(); // warm-up.
+    cv::TickMeter tm;
+    tm.start();
+    for (int i = 0; i < iterations; ++i)
+        f();
+    tm.stop();
+    return tm.getTimeMilli() / iterations;
+}
+
+/**
+ * @brief Original correlation: one ROI, product and sum per output pixel.
+ */
+cv::Mat naive_filter2D(cv::Mat const &in, cv::Mat const &filter)
+{
+    cv::Mat out(in.rows - 2 * (filter.rows / 2), in.cols - 2 * (filter.cols / 2), CV_32F);
+    for (int i = 0; i < out.rows; ++i)
+        for (int j = 0; j < out.cols; ++j)
+            out.at<float>(i, j) = static_cast<float>(
+                cv::sum(in(cv::Rect(j, i, filter.cols, filter.rows)).mul(filter))[0]);
+    return out;
+}
+
+/**
+ * @brief Units of work of each backend in the cost model for a Gaussian blur.
+ */
+void cost_units(cv::Size size, int r, double units[3])
+{
+    const double pixels = static_cast<double>(size.area());
+    const double ksize = 2.0 * r + 1.0;
+    const double points = static_cast<double>(
+        cv::getOptimalDFTSize(size.width + 2 * r) *
+        cv::getOptimalDFTSize(size.height + 2 * r));
+    units[FSIV_CONV_DIRECT] = pixels * ksize * ksize;
+    units[FSIV_CONV_SEPARABLE] = pixels * 2.0 * ksize;
+    units[FSIV_CONV_DFT] = points * std::log2(points);
+}
+
+/**
+ * @brief Time the backends of the Gaussian blur, fit the cost model with a
+ * least squares line through the origin and install it.
+ */
+void calibrate_cost_model(int iterations, int max_direct_r)
+{
+    const char *names[] = {"direct", "separable", "DFT"};
+    const cv::Size size(1024, 768);
+    cv::Mat in(size, CV_32FC1);
+    cv::randu(in, cv::Scalar(0.0), cv::Scalar(1.0));
+    const int radii[] = {1, 2, 4, 8, 16, 32, 64};
+    const int n_radii = sizeof(radii) / sizeof(radii[0]);
+
+    std::vector<std::vector<double>> ms(n_radii, std::vector<double>(3, -1.0));
+    double tu[3] = {0.0, 0.0, 0.0}, uu[3] = {0.0, 0.0, 0.0};
+    std::cout << "Gaussian blur backends, " << size.width << "x" << size.height
+              << ":" << std::endl;
+    for (int i = 0; i < n_radii; ++i)
+    {
+        const int r = radii[i];
+        const cv::Mat expanded = fsiv_fill_expansion(in, r);
+        double units[3];
+        cost_units(size, r, units);
+        std::cout << "  r=" << r << ":";
+        for (int b = FSIV_CONV_DIRECT; b <= FSIV_CONV_DFT; ++b)
+        {
+            if (b == FSIV_CONV_DIRECT && r > max_direct_r)
+                continue;
+            ms[i][b] = time_ms([&]()
+                               { fsiv_usm_blur(expanded, r, 1, b); },
+                               iterations);
+            tu[b] += ms[i][b] * 1.0e6 * units[b];
+            uu[b] += units[b] * units[b];
+            std::cout << " " << names[b] << " " << ms[i][b] << " ms";
+        }
+        std::cout << std::endl;
+    }
+
+    // A backend that was not timed keeps its current constant.
+    ConvCostModel model = fsiv_get_conv_cost_model();
+    if (uu[FSIV_CONV_DIRECT] > 0.0)
+        model.direct_tap = tu[FSIV_CONV_DIRECT] / uu[FSIV_CONV_DIRECT];
+    model.separable_tap = tu[FSIV_CONV_SEPARABLE] / uu[FSIV_CONV_SEPARABLE];
+    model.dft_point = tu[FSIV_CONV_DFT] / uu[FSIV_CONV_DFT];
+    fsiv_set_conv_cost_model(model);
+    std::cout << "calibrated cost model (ns), use it with usm_enhance -k="
+              << model.direct_tap << "," << model.separable_tap << ","
+              << model.dft_point << std::endl;
+    for (int i = 0; i < n_radii; ++i)
+    {
+        int fastest = FSIV_CONV_SEPARABLE;
+        for (int b = FSIV_CONV_DIRECT; b <= FSIV_CONV_DFT; ++b)
+            if (ms[i][b] >= 0.0 && ms[i][b] < ms[i][fastest])
+                fastest = b;
+        std::cout << "  r=" << radii[i] << ": chosen "
+                  << names[fsiv_choose_conv_backend(size, radii[i], 1)]
+                  << ", fastest " << names[fastest] << std::endl;
+    }
+}
+
+/**
+ * @brief Time the blur of an explicitly expanded image against the blur
+ * with a virtual border.
+ */
+void bench_virtual_border(int iterations)
+{
+    const cv::Size size(1920, 1080);
+    cv::Mat in(size, CV_32FC1);
+    cv::randu(in, cv::Scalar(0.0), cv::Scalar(1.0));
+    std::cout << "virtual border, Gaussian blur, circular, " << size.width
+              << "x" << size.height << ":" << std::endl;
+    const int radii[] = {2, 8, 32};
+    for (size_t i = 0; i < sizeof(radii) / sizeof(radii[0]); ++i)
+    {
+        const int r = radii[i];
+        cv::Mat ref, out;
+        const double expanded_ms = time_ms([&]()
+                                           { ref = fsiv_usm_blur(fsiv_circular_expansion(in, r), r, 1); },
+                                           iterations);
+        const double virtual_ms = time_ms([&]()
+                                          { out = fsiv_blur(in, r, 1, true); },
+                                          iterations);
+        std::cout << "  r=" << r << ": expanded " << expanded_ms
+                  << " ms, virtual " << virtual_ms << " ms, saved "
+                  << (size.width + 2 * r) * (size.height + 2 * r) * sizeof(float) / 1.0e6
+                  << " MB, max abs diff " << cv::norm(ref, out, cv::NORM_INF)
+                  << std::endl;
+    }
+}
+
+/**
+ * @brief Time the multi-scale enhance against one unsharp mask per scale.
+ */
+void bench_multiscale(int iterations)
+{
+    const cv::Size size(1920, 1080);
+    cv::Mat in(size, CV_32FC1);
+    cv::randu(in, cv::Scalar(0.0), cv::Scalar(1.0));
+    const std::vector<int> radii = {2, 8, 32};
+    const std::vector<double> gains = {1.0, 0.5, 0.25};
+    cv::Mat ref, out;
+    const double separate_ms = time_ms([&]()
+                                       {
+                                           ref = in.clone();
+                                           for (size_t k = 0; k < radii.size(); ++k)
+                                               ref += fsiv_usm_enhance(in, gains[k], radii[k], 1) - in;
+                                       },
+                                       iterations);
+    const double largest_ms = time_ms([&]()
+                                      { out = fsiv_usm_enhance(in, gains.back(), radii.back(), 1); },
+                                      iterations);
+    const double pyramid_ms = time_ms([&]()
+                                      { out = fsiv_multiscale_usm_enhance(in, radii, gains); },
+                                      iterations);
+    std::cout << "multi-scale r={2, 8, 32}, " << size.width << "x"
+              << size.height << ": separate " << separate_ms
+              << " ms, pyramid " << pyramid_ms << " ms, largest scale alone "
+              << largest_ms << " ms, max abs diff "
+              << cv::norm(ref, out, cv::NORM_INF) << std::endl;
+}
+
+/**
+ * @brief Time the enhance with the combine fused in the blur engine against
+ * a blur followed by a separate combine pass.
+ */
+void bench_fused_combine(int iterations)
+{
+    const cv::Size size(1920, 1080);
+    cv::Mat in(size, CV_32FC1);
+    cv::randu(in, cv::Scalar(0.0), cv::Scalar(1.0));
+    std::cout << "fused combine, Gaussian, " << size.width << "x" << size.height
+              << ":" << std::endl;
+    const int radii[] = {1, 4, 16};
+    for (size_t i = 0; i < sizeof(radii) / sizeof(radii[0]); ++i)
+    {
+        const int r = radii[i];
+        cv::Mat ref, out;
+        const double separate_ms = time_ms([&]()
+                                           { ref = fsiv_combine_images(in, fsiv_blur(in, r, 1, false), 2.0, -1.0); },
+                                           iterations);
+        const double fused_ms = time_ms([&]()
+                                        { out = fsiv_usm_enhance(in, 1.0, r, 1); },
+                                        iterations);
+        std::cout << "  r=" << r << ": separate " << separate_ms << " ms, fused "
+                  << fused_ms << " ms, max abs diff "
+                  << cv::norm(ref, out, cv::NORM_INF) << std::endl;
+    }
+}
+
+/**
+ * @brief Compare the adaptive enhance with the plain enhance followed by a
+ * denoise pass on a noisy step edge: time, noise left on the flat side and
+ * contrast of the edge.
+ */
+void bench_adaptive(int iterations)
+{
+    const cv::Size size(1920, 1080);
+    cv::Mat in(size, CV_32FC1, cv::Scalar(0.3));
+    in.colRange(size.width / 2, size.width).setTo(0.7);
+    cv::Mat noise(size, CV_32FC1);
+    cv::randn(noise, cv::Scalar(0.0), cv::Scalar(0.01));
+    in += noise;
+    const cv::Rect flat(0, 0, size.width / 4, size.height);
+    const int x_edge = size.width / 2;
+    auto report = [&](const char *name, double ms, const cv::Mat &out)
+    {
+        cv::Scalar mean, stddev;
+        cv::meanStdDev(out(flat), mean, stddev);
+        std::cout << "  " << name << ": " << ms << " ms, flat noise stddev "
+                  << stddev[0] << ", edge step "
+                  << cv::mean(out.col(x_edge))[0] - cv::mean(out.col(x_edge - 1))[0]
+                  << std::endl;
+    };
+    std::cout << "adaptive enhance, g=2, r=3, noisy step edge " << size.width
+              << "x" << size.height << " (input noise stddev 0.01):" << std::endl;
+    cv::Mat out;
+    double ms = time_ms([&]()
+                        { out = fsiv_usm_enhance(in, 2.0, 3, 1); },
+                        iterations);
+    report("plain", ms, out);
+    ms = time_ms([&]()
+                 { cv::medianBlur(fsiv_usm_enhance(in, 2.0, 3, 1), out, 5); },
+                 iterations);
+    report("plain + median 5x5", ms, out);
+    ms = time_ms([&]()
+                 { out = fsiv_adaptive_usm_enhance(in, 2.0, 3, 0.03, 1); },
+                 iterations);
+    report("adaptive t=0.03", ms, out);
+}
+
+int main(int argc, char *const *argv)
+{
+    int retCode = EXIT_SUCCESS;
+
+    try
+    {
+        cv::CommandLineParser parser(argc, argv, keys);
+        parser.about("Benchmark the unsharp mask filtering engines.");
+        if (parser.has("help"))
+        {
+            parser.printMessage();
+            return EXIT_SUCCESS;
+        }
+        const int iterations = parser.get<int>("n");
+        const int max_direct_r = parser.get<int>("max_direct_r");
+        if (!parser.check())
+        {
+            parser.printErrors();
+            return EXIT_FAILURE;
+        }
+
+        cv::Mat in(480, 640, CV_32FC1);
+        cv::randu(in, cv::Scalar(0.0), cv::Scalar(1.0));
+        const int radii[] = {1, 2, 4, 8};
+        std::cout << "direct correlation, " << in.cols << "x" << in.rows
+                  << ":" << std::endl;
+        for (size_t i = 0; i < sizeof(radii) / sizeof(radii[0]); ++i)
+        {
+            const int r = radii[i];
+            const cv::Mat expanded = fsiv_fill_expansion(in, r);
+            const cv::Mat filter = fsiv_create_gaussian_filter(r);
+            cv::Mat ref, out;
+            const double naive_ms = time_ms([&]()
+                                            { ref = naive_filter2D(expanded, filter); },
+                                            iterations);
+            const double direct_ms = time_ms([&]()
+                                             { out = fsiv_filter2D(expanded, filter); },
+                                             iterations);
+            std::cout << "  r=" << r << ": naive " << naive_ms << " ms, direct "
+                      << direct_ms << " ms, speedup " << naive_ms / direct_ms
+                      << "x, max abs diff " << cv::norm(ref, out, cv::NORM_INF)
+                      << std::endl;
+        }
+
+        calibrate_cost_model(iterations, max_direct_r);
+        bench_virtual_border(iterations);
+        bench_multiscale(iterations);
+        bench_fused_combine(iterations);
+        bench_adaptive(iterations);
+    }
+    catch (std::exception &e)
+    {
+        std::cerr << "Exception: " << e.what() << std::endl;
+        retCode = EXIT_FAILURE;
+    }
+    return retCode;
+}
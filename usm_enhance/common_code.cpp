@@ -9,8 +9,587 @@
  *
  */
 #include "common_code.hpp"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include <opencv2/core/utility.hpp>
+#include <opencv2/core/hal/intrin.hpp>
 #include <opencv2/imgproc.hpp>
 
+namespace
+{
+
+// Store dst[x] += coef * src[x] for a row of n samples.
+inline void
+accumulate_tap(const float *src, float coef, float *dst, int n)
+{
+    int x = 0;
+#if CV_SIMD128
+    const cv::v_float32x4 v_coef = cv::v_setall_f32(coef);
+    for (; x <= n - 8; x += 8)
+    {
+        cv::v_store(dst + x, cv::v_fma(v_coef, cv::v_load(src + x), cv::v_load(dst + x)));
+        cv::v_store(dst + x + 4, cv::v_fma(v_coef, cv::v_load(src + x + 4), cv::v_load(dst + x + 4)));
+    }
+    for (; x <= n - 4; x += 4)
+        cv::v_store(dst + x, cv::v_fma(v_coef, cv::v_load(src + x), cv::v_load(dst + x)));
+#endif
+    for (; x < n; ++x)
+        dst[x] += coef * src[x];
+}
+
+// Correlate output row y of a valid correlation: the n samples of dst are
+// the sum over the filter taps (i, j) of filter(i, j) * in(y + i, x + j).
+// The whole output row is accumulated tap by tap, so it stays in cache and
+// the inner loop is a contiguous multiply-add.
+void
+correlate_row(cv::Mat const &in, cv::Mat const &filter, int y, float *dst,
+              int n)
+{
+    std::fill(dst, dst + n, 0.0f);
+    for (int i = 0; i < filter.rows; ++i)
+    {
+        const float *src = in.ptr<float>(y + i);
+        const float *coef = filter.ptr<float>(i);
+        for (int j = 0; j < filter.cols; ++j)
+            if (coef[j] != 0.0f)
+                accumulate_tap(src + j, coef[j], dst, n);
+    }
+}
+
+// Row of the image read for the virtual row y: y itself inside the image,
+// -1 (a zero row) outside it with zero padding, or y wrapped around with
+// circular expansion.
+inline int
+virtual_row(int y, int rows, bool circular)
+{
+    if (y >= 0 && y < rows)
+        return y;
+    if (!circular)
+        return -1;
+    y %= rows;
+    return y < 0 ? y + rows : y;
+}
+
+// Store dst[x] += coef * src[x + d] for a row of n samples, reading src with
+// a virtual border. With zero padding the interior run is one contiguous
+// multiply-add and the samples out of the row are skipped. With circular
+// expansion the shift is taken modulo n, so any radius works, and the
+// samples out of the row wrap around to the other end as a second
+// contiguous run.
+inline void
+accumulate_shifted(const float *src, int n, int d, float coef, bool circular,
+                   float *dst)
+{
+    if (circular)
+    {
+        d %= n;
+        if (d < 0)
+            d += n;
+        accumulate_tap(src + d, coef, dst, n - d);
+        if (d > 0)
+            accumulate_tap(src, coef, dst + n - d, d);
+        return;
+    }
+    const int begin = std::max(0, -d);
+    const int end = std::min(n, n - d);
+    if (begin < end)
+        accumulate_tap(src + begin + d, coef, dst + begin, end - begin);
+}
+
+// Store dst[x] = (g + 1) * in[x] - g * blur[x] for a row of n samples.
+inline void
+combine_row(const float *in, const float *blur, float g, float *dst, int n)
+{
+    const float a = g + 1.0f;
+    int x = 0;
+#if CV_SIMD128
+    const cv::v_float32x4 v_a = cv::v_setall_f32(a);
+    const cv::v_float32x4 v_g = cv::v_setall_f32(g);
+    for (; x <= n - 4; x += 4)
+        cv::v_store(dst + x, v_a * cv::v_load(in + x) - v_g * cv::v_load(blur + x));
+#endif
+    for (; x < n; ++x)
+        dst[x] = a * in[x] - g * blur[x];
+}
+
+// Store the adaptive enhance of a row of n samples: with the detail
+// d = in - blur, dst = in + g * w * d where the weight w ramps from 0 at
+// |d| <= t to 1 at |d| >= 2t, so small (noise) details are not amplified.
+// Pre: t > 0.
+inline void
+adaptive_combine_row(const float *in, const float *blur, float g, float t,
+                     float *dst, int n)
+{
+    const float inv_t = 1.0f / t;
+    int x = 0;
+#if CV_SIMD128
+    const cv::v_float32x4 v_g = cv::v_setall_f32(g);
+    const cv::v_float32x4 v_t = cv::v_setall_f32(t);
+    const cv::v_float32x4 v_inv_t = cv::v_setall_f32(inv_t);
+    const cv::v_float32x4 zero = cv::v_setzero_f32();
+    const cv::v_float32x4 one = cv::v_setall_f32(1.0f);
+    for (; x <= n - 4; x += 4)
+    {
+        const cv::v_float32x4 v_in = cv::v_load(in + x);
+        const cv::v_float32x4 d = v_in - cv::v_load(blur + x);
+        const cv::v_float32x4 w = cv::v_min(cv::v_max((cv::v_abs(d) - v_t) * v_inv_t, zero), one);
+        cv::v_store(dst + x, cv::v_fma(v_g * w, d, v_in));
+    }
+#endif
+    for (; x < n; ++x)
+    {
+        const float d = in[x] - blur[x];
+        const float w = std::min(std::max((std::abs(d) - t) * inv_t, 0.0f), 1.0f);
+        dst[x] = in[x] + g * w * d;
+    }
+}
+
+// Unsharp combine fused in the last row loop of a blur engine. When it is
+// given, the engine stores *out = (g + 1) * (*in) - g * blur row by row, while
+// the row of the blur is still in cache, and it only returns the blur if
+// keep_blur is true (otherwise each row is computed in a scratch row).
+// With threshold > 0 the adaptive enhance is stored instead.
+struct UsmCombine
+{
+    cv::Mat const *in;
+    cv::Mat *out;
+    float g;
+    bool keep_blur;
+    float threshold;
+};
+
+// Blur returned by an engine: allocated unless it is only used by the
+// combine. Also allocates the output of the combine.
+cv::Mat
+create_blur(cv::Size size, UsmCombine const *combine)
+{
+    if (combine == nullptr)
+        return cv::Mat(size, CV_32F);
+    combine->out->create(size, CV_32F);
+    return combine->keep_blur ? cv::Mat(size, CV_32F) : cv::Mat();
+}
+
+// Row y of the blur of an engine: a row of the returned blur or the
+// scratch row.
+inline float *
+blur_row(cv::Mat &blur, std::vector<float> &scratch, int y)
+{
+    return blur.empty() ? scratch.data() : blur.ptr<float>(y);
+}
+
+// Last step of row y of an engine: the fused combine, if any.
+inline void
+finish_row(UsmCombine const *combine, int y, const float *blur)
+{
+    if (combine == nullptr)
+        return;
+    if (combine->threshold > 0.0f)
+        adaptive_combine_row(combine->in->ptr<float>(y), blur, combine->g,
+                             combine->threshold, combine->out->ptr<float>(y),
+                             combine->in->cols);
+    else
+        combine_row(combine->in->ptr<float>(y), blur, combine->g,
+                    combine->out->ptr<float>(y), combine->in->cols);
+}
+
+// Same size correlation with a dense filter and a virtual border.
+cv::Mat
+filter2D_virtual_border(cv::Mat const &in, cv::Mat const &filter, bool circular,
+                        UsmCombine const *combine = nullptr)
+{
+    const int ry = filter.rows / 2;
+    const int rx = filter.cols / 2;
+    cv::Mat ret_v = create_blur(in.size(), combine);
+    cv::parallel_for_(cv::Range(0, in.rows), [&](const cv::Range &rows)
+    {
+        std::vector<float> scratch(ret_v.empty() ? in.cols : 0);
+        for (int y = rows.start; y < rows.end; ++y)
+        {
+            float *dst = blur_row(ret_v, scratch, y);
+            std::fill(dst, dst + in.cols, 0.0f);
+            for (int i = 0; i < filter.rows; ++i)
+            {
+                const int sy = virtual_row(y + i - ry, in.rows, circular);
+                if (sy < 0)
+                    continue;
+                const float *src = in.ptr<float>(sy);
+                const float *coef = filter.ptr<float>(i);
+                for (int j = 0; j < filter.cols; ++j)
+                    if (coef[j] != 0.0f)
+                        accumulate_shifted(src, in.cols, j - rx, coef[j],
+                                           circular, dst);
+            }
+            finish_row(combine, y, dst);
+        }
+    });
+    return ret_v;
+}
+
+// Same size separable correlation with a virtual border.
+cv::Mat
+separable_filter2D_virtual_border(cv::Mat const &in, cv::Mat const &kernel,
+                                  bool circular,
+                                  UsmCombine const *combine = nullptr)
+{
+    const int ksize = static_cast<int>(kernel.total());
+    const int r = ksize / 2;
+    const cv::Mat k = kernel.isContinuous() ? kernel : kernel.clone();
+    const float *coef = k.ptr<float>();
+
+    cv::Mat tmp(in.rows, in.cols, CV_32F);
+    cv::parallel_for_(cv::Range(0, in.rows), [&](const cv::Range &rows)
+    {
+        for (int y = rows.start; y < rows.end; ++y)
+        {
+            float *dst = tmp.ptr<float>(y);
+            std::fill(dst, dst + in.cols, 0.0f);
+            for (int j = 0; j < ksize; ++j)
+                accumulate_shifted(in.ptr<float>(y), in.cols, j - r, coef[j],
+                                   circular, dst);
+        }
+    });
+
+    cv::Mat ret_v = create_blur(in.size(), combine);
+    cv::parallel_for_(cv::Range(0, in.rows), [&](const cv::Range &rows)
+    {
+        std::vector<float> scratch(ret_v.empty() ? in.cols : 0);
+        for (int y = rows.start; y < rows.end; ++y)
+        {
+            float *dst = blur_row(ret_v, scratch, y);
+            std::fill(dst, dst + in.cols, 0.0f);
+            for (int i = 0; i < ksize; ++i)
+            {
+                const int sy = virtual_row(y + i - r, in.rows, circular);
+                if (sy >= 0)
+                    accumulate_tap(tmp.ptr<float>(sy), coef[i], dst, in.cols);
+            }
+            finish_row(combine, y, dst);
+        }
+    });
+    return ret_v;
+}
+
+// Same size running sum box filter with a virtual border. The column sums
+// are kept with r extra entries per side, which are zero with zero padding
+// or copies of the opposite side with circular expansion, so the row sum
+// slides over them without any test. Each stripe pays a ksize rows warm up,
+// hence the bounded stripe count.
+cv::Mat
+box_filter_virtual_border(cv::Mat const &in, int r, bool circular,
+                          UsmCombine const *combine = nullptr)
+{
+    const int ksize = 2 * r + 1;
+    const double norm = 1.0 / (double(ksize) * ksize);
+    cv::Mat ret_v = create_blur(in.size(), combine);
+    const int nstripes = std::max(1, std::min(in.rows, 4 * cv::getNumThreads()));
+    cv::parallel_for_(cv::Range(0, in.rows), [&](const cv::Range &rows)
+    {
+        std::vector<float> scratch(ret_v.empty() ? in.cols : 0);
+        std::vector<double> ext(in.cols + 2 * r, 0.0);
+        double *col_sum = ext.data() + r;
+        auto add_row = [&](int y, double w)
+        {
+            const int sy = virtual_row(y, in.rows, circular);
+            if (sy < 0)
+                return;
+            const float *src = in.ptr<float>(sy);
+            for (int x = 0; x < in.cols; ++x)
+                col_sum[x] += w * src[x];
+        };
+        for (int k = rows.start - r; k <= rows.start + r; ++k)
+            add_row(k, 1.0);
+        for (int y = rows.start; y < rows.end; ++y)
+        {
+            if (y > rows.start)
+            {
+                add_row(y + r, 1.0);
+                add_row(y - r - 1, -1.0);
+            }
+            if (circular)
+                for (int k = 0; k < r; ++k)
+                {
+                    ext[k] = col_sum[virtual_row(k - r, in.cols, true)];
+                    col_sum[in.cols + k] = col_sum[virtual_row(in.cols + k, in.cols, true)];
+                }
+            float *dst = blur_row(ret_v, scratch, y);
+            double sum = 0.0;
+            for (int x = 0; x < ksize; ++x)
+                sum += ext[x];
+            dst[0] = static_cast<float>(sum * norm);
+            for (int x = 1; x < in.cols; ++x)
+            {
+                sum += ext[x + ksize - 1] - ext[x - 1];
+                dst[x] = static_cast<float>(sum * norm);
+            }
+            finish_row(combine, y, dst);
+        }
+    }, nstripes);
+    return ret_v;
+}
+
+// Taps of the binomial filter of cv::pyrDown() and cv::pyrUp(), of variance 1.
+const float PYR_TAPS[5] = {1.0f / 16, 4.0f / 16, 6.0f / 16, 4.0f / 16, 1.0f / 16};
+
+// Smallest side of a reduced pyramid level.
+const int PYR_MIN_SIZE = 8;
+
+// Fill the p entries at each side of a row of n samples stored from ext[p]:
+// zeros with zero padding or the other end of the row with circular expansion.
+inline void
+fill_row_pads(float *ext, int n, int p, bool circular)
+{
+    for (int k = 0; k < p; ++k)
+    {
+        ext[k] = circular ? ext[p + virtual_row(k - p, n, true)] : 0.0f;
+        ext[p + n + k] = circular ? ext[p + virtual_row(n + k, n, true)] : 0.0f;
+    }
+}
+
+// Gaussian pyramid reduce as cv::pyrDown(), binomial filter and decimation
+// to ((rows+1)/2, (cols+1)/2), but with a virtual border. Only the kept rows
+// and columns are filtered.
+cv::Mat
+pyramid_down(cv::Mat const &in, bool circular)
+{
+    cv::Mat ret_v((in.rows + 1) / 2, (in.cols + 1) / 2, CV_32F);
+    cv::parallel_for_(cv::Range(0, ret_v.rows), [&](const cv::Range &rows)
+    {
+        std::vector<float> ext(in.cols + 4);
+        for (int y = rows.start; y < rows.end; ++y)
+        {
+            std::fill(ext.begin(), ext.end(), 0.0f);
+            for (int i = 0; i < 5; ++i)
+            {
+                const int sy = virtual_row(2 * y + i - 2, in.rows, circular);
+                if (sy >= 0)
+                    accumulate_tap(in.ptr<float>(sy), PYR_TAPS[i], ext.data() + 2,
+                                   in.cols);
+            }
+            fill_row_pads(ext.data(), in.cols, 2, circular);
+            float *dst = ret_v.ptr<float>(y);
+            for (int x = 0; x < ret_v.cols; ++x)
+            {
+                const float *src = ext.data() + 2 * x;
+                dst[x] = PYR_TAPS[0] * (src[0] + src[4]) +
+                         PYR_TAPS[1] * (src[1] + src[3]) + PYR_TAPS[2] * src[2];
+            }
+        }
+    });
+    return ret_v;
+}
+
+// Gaussian pyramid expand as cv::pyrUp(), but with a virtual border: size is
+// the size of the level in was reduced from, and the binomial filter scaled
+// by 2 per axis interpolates the missing samples, so an even row (column)
+// weighs the nearest three input ones by 1/8, 3/4 and 1/8 and an odd one the
+// nearest two by 1/2.
+cv::Mat
+pyramid_up(cv::Mat const &in, cv::Size size, bool circular)
+{
+    cv::Mat ret_v(size, CV_32F);
+    cv::parallel_for_(cv::Range(0, size.height), [&](const cv::Range &rows)
+    {
+        std::vector<float> ext(in.cols + 2);
+        auto add_row = [&](int y, float w)
+        {
+            const int sy = virtual_row(y, in.rows, circular);
+            if (sy >= 0)
+                accumulate_tap(in.ptr<float>(sy), w, ext.data() + 1, in.cols);
+        };
+        for (int y = rows.start; y < rows.end; ++y)
+        {
+            std::fill(ext.begin(), ext.end(), 0.0f);
+            const int m = y / 2;
+            if (y % 2 == 0)
+            {
+                add_row(m - 1, 0.125f);
+                add_row(m, 0.75f);
+                add_row(m + 1, 0.125f);
+            }
+            else
+            {
+                add_row(m, 0.5f);
+                add_row(m + 1, 0.5f);
+            }
+            fill_row_pads(ext.data(), in.cols, 1, circular);
+            const float *src = ext.data() + 1;
+            float *dst = ret_v.ptr<float>(y);
+            for (int x = 0; x < size.width; ++x)
+            {
+                const int n = x / 2;
+                dst[x] = x % 2 == 0
+                             ? 0.125f * (src[n - 1] + src[n + 1]) + 0.75f * src[n]
+                             : 0.5f * (src[n] + src[n + 1]);
+            }
+        }
+    });
+    return ret_v;
+}
+
+// Optimal DFT size to correlate an image of the given size.
+cv::Size
+optimal_dft_size(cv::Size size)
+{
+    return cv::Size(cv::getOptimalDFTSize(size.width),
+                    cv::getOptimalDFTSize(size.height));
+}
+
+// Spectrum of a filter zero padded to dft_size.
+cv::Mat
+filter_spectrum(cv::Mat const &filter, cv::Size dft_size)
+{
+    cv::Mat padded = cv::Mat::zeros(dft_size, CV_32F);
+    filter.copyTo(padded(cv::Rect(0, 0, filter.cols, filter.rows)));
+    cv::Mat spectrum;
+    cv::dft(padded, spectrum, 0, filter.rows);
+    return spectrum;
+}
+
+// Valid correlation, of size out_size, of the image stored at the top left
+// corner of padded (only its first nonzero_rows rows are not zero) with the
+// filter whose spectrum is given. The product with the conjugated filter
+// spectrum is the circular correlation, and the padding makes its valid
+// region free of wrap around. The result is a view of the inverse transform.
+cv::Mat
+dft_correlate(cv::Mat const &padded, int nonzero_rows, cv::Mat const &spectrum,
+              cv::Size out_size)
+{
+    cv::Mat in_spectrum, corr;
+    cv::dft(padded, in_spectrum, 0, nonzero_rows);
+    cv::mulSpectrums(in_spectrum, spectrum, in_spectrum, 0, true);
+    cv::dft(in_spectrum, corr, cv::DFT_INVERSE | cv::DFT_SCALE | cv::DFT_REAL_OUTPUT,
+            out_size.height);
+    return corr(cv::Rect(cv::Point(0, 0), out_size));
+}
+
+// Filter spectrum of the last blur done with the DFT backend.
+struct SpectrumCache
+{
+    int r = 0;
+    int filter_type = -1;
+    cv::Size dft_size;
+    cv::Mat spectrum;
+};
+
+// Sigma of the Gaussian filter of radius r, as cv::getGaussianKernel()
+// computes it for a kernel of size 2r+1.
+inline double
+gaussian_sigma(int r)
+{
+    return 0.3 * (r - 1) + 0.8;
+}
+
+// Luma weights of B, G and R scaled from [0, 255] to [0, 1].
+const float LUMA_B = static_cast<float>(0.114 / 255.0);
+const float LUMA_G = static_cast<float>(0.587 / 255.0);
+const float LUMA_R = static_cast<float>(0.299 / 255.0);
+
+#if CV_SIMD128
+// Convert 16 8-bit samples to four vectors of floats.
+inline void
+expand_to_f32(const cv::v_uint8x16 &v, cv::v_float32x4 f[4])
+{
+    cv::v_uint16x8 w0, w1;
+    cv::v_uint32x4 d[4];
+    cv::v_expand(v, w0, w1);
+    cv::v_expand(w0, d[0], d[1]);
+    cv::v_expand(w1, d[2], d[3]);
+    for (int k = 0; k < 4; ++k)
+        f[k] = cv::v_cvt_f32(cv::v_reinterpret_as_s32(d[k]));
+}
+#endif
+
+// Store the luma of a row of n BGR pixels.
+void
+bgr_to_luma_row(const uchar *src, float *dst, int n)
+{
+    int x = 0;
+#if CV_SIMD128
+    const cv::v_float32x4 kb = cv::v_setall_f32(LUMA_B);
+    const cv::v_float32x4 kg = cv::v_setall_f32(LUMA_G);
+    const cv::v_float32x4 kr = cv::v_setall_f32(LUMA_R);
+    for (; x <= n - 16; x += 16)
+    {
+        cv::v_uint8x16 b, g, r;
+        cv::v_load_deinterleave(src + 3 * x, b, g, r);
+        cv::v_float32x4 fb[4], fg[4], fr[4];
+        expand_to_f32(b, fb);
+        expand_to_f32(g, fg);
+        expand_to_f32(r, fr);
+        for (int k = 0; k < 4; ++k)
+            cv::v_store(dst + x + 4 * k,
+                        cv::v_fma(fr[k], kr, cv::v_fma(fg[k], kg, fb[k] * kb)));
+    }
+#endif
+    for (; x < n; ++x)
+        dst[x] = LUMA_R * src[3 * x + 2] + (LUMA_G * src[3 * x + 1] + LUMA_B * src[3 * x]);
+}
+
+// Store dst = saturate(src + k * (luma - blur)) for every channel of a row of
+// n BGR pixels.
+void
+add_luma_detail_row(const uchar *src, const float *luma, const float *blur,
+                    float k, uchar *dst, int n)
+{
+    int x = 0;
+#if CV_SIMD128
+    const cv::v_float32x4 v_k = cv::v_setall_f32(k);
+    for (; x <= n - 16; x += 16)
+    {
+        cv::v_float32x4 delta[4];
+        for (int i = 0; i < 4; ++i)
+            delta[i] = v_k * (cv::v_load(luma + x + 4 * i) - cv::v_load(blur + x + 4 * i));
+        cv::v_uint8x16 planes[3];
+        cv::v_load_deinterleave(src + 3 * x, planes[0], planes[1], planes[2]);
+        for (int c = 0; c < 3; ++c)
+        {
+            cv::v_float32x4 f[4];
+            expand_to_f32(planes[c], f);
+            cv::v_int32x4 v[4];
+            for (int i = 0; i < 4; ++i)
+                v[i] = cv::v_round(f[i] + delta[i]);
+            planes[c] = cv::v_pack_u(cv::v_pack(v[0], v[1]), cv::v_pack(v[2], v[3]));
+        }
+        cv::v_store_interleave(dst + 3 * x, planes[0], planes[1], planes[2]);
+    }
+#endif
+    for (; x < n; ++x)
+    {
+        const float delta = k * (luma[x] - blur[x]);
+        for (int c = 0; c < 3; ++c)
+            dst[3 * x + c] = cv::saturate_cast<uchar>(src[3 * x + c] + delta);
+    }
+}
+
+// Least squares fit of the Gaussian blur timings of calibrate_cost_model()
+// (1024x768, r=1..64) on one thread of an Intel Xeon server (AVX-512
+// capable, SSE3 baseline build). See ConvCostModel.
+ConvCostModel cost_model = {0.18, 0.42, 2.1};
+
+// Spectrum of the usm filter for the DFT backend. It is cached for the last
+// (r, filter_type, DFT size) used by the calling thread.
+cv::Mat const &
+usm_filter_spectrum(int r, int filter_type, cv::Size dft_size)
+{
+    // One cache per thread so concurrent callers do not share spectra.
+    static thread_local SpectrumCache cache;
+    if (cache.r != r || cache.filter_type != filter_type ||
+        cache.dft_size != dft_size)
+    {
+        cache.spectrum = filter_spectrum(
+            filter_type == 0 ? fsiv_create_box_filter(r)
+                             : fsiv_create_gaussian_filter(r),
+            dft_size);
+        cache.r = r;
+        cache.filter_type = filter_type;
+        cache.dft_size = dft_size;
+    }
+    return cache.spectrum;
+}
+
+} // namespace
+
 cv::Mat
 fsiv_create_box_filter(const int r)
 {
@@ -51,6 +630,17 @@ fsiv_create_gaussian_filter(const int r)
     return ret_v;
 }
 
+cv::Mat
+fsiv_create_gaussian_kernel_1d(const int r)
+{
+    CV_Assert(r > 0);
+    cv::Mat ret_v = cv::getGaussianKernel(2 * r + 1, 0, CV_32F);
+    CV_Assert(ret_v.type() == CV_32FC1);
+    CV_Assert(ret_v.rows == (2 * r + 1) && ret_v.cols == 1);
+    CV_Assert(std::abs(1.0 - cv::sum(ret_v)[0]) < 1.0e-6);
+    return ret_v;
+}
+
 cv::Mat
 fsiv_fill_expansion(cv::Mat const &in, const int r)
 {
@@ -111,26 +701,263 @@ fsiv_filter2D(cv::Mat const &in, cv::Mat const &filter)
 
     ret_v = cv::Mat(in.rows - 2 * (filter.rows / 2), in.cols - 2 * (filter.cols / 2), CV_32F);
 
-    for (size_t i = 0; i < in.rows - 2 * (filter.rows / 2); ++i)
+    // No temporary per pixel: each output row is accumulated in place from
+    // the raw input rows, and the rows are shared among the threads.
+    cv::parallel_for_(cv::Range(0, ret_v.rows), [&](const cv::Range &rows)
     {
-        for (size_t j = 0; j < in.cols - 2 * (filter.cols / 2); ++j)
+        for (int y = rows.start; y < rows.end; ++y)
+            correlate_row(in, filter, y, ret_v.ptr<float>(y), ret_v.cols);
+    });
+
+    //
+    CV_Assert(ret_v.type() == CV_32FC1);
+    CV_Assert(ret_v.rows == in.rows - 2 * (filter.rows / 2));
+    CV_Assert(ret_v.cols == in.cols - 2 * (filter.cols / 2));
+    return ret_v;
+}
+
+cv::Mat
+fsiv_box_filter(cv::Mat const &in, const int r)
+{
+    CV_Assert(!in.empty() && in.type() == CV_32FC1);
+    CV_Assert(r > 0 && in.rows > 2 * r && in.cols > 2 * r);
+    const int ksize = 2 * r + 1;
+    const double norm = 1.0 / (double(ksize) * ksize);
+    cv::Mat ret_v(in.rows - 2 * r, in.cols - 2 * r, CV_32F);
+
+    // Each stripe of output rows starts its own column sums, so the stripes
+    // are independent. Sums are kept in double to avoid the drift of adding
+    // and subtracting floats along the sliding window. Every stripe pays a
+    // ksize rows warm up, so the stripe count is bounded explicitly instead
+    // of letting the backend split the rows as finely as it likes.
+    const int nstripes = std::max(1, std::min(ret_v.rows, 4 * cv::getNumThreads()));
+    cv::parallel_for_(cv::Range(0, ret_v.rows), [&](const cv::Range &rows)
+    {
+        std::vector<double> col_sum(in.cols, 0.0);
+        for (int k = rows.start; k < rows.start + ksize; ++k)
         {
-            cv::Rect roi(j, i, filter.rows, filter.cols);
-            cv::Mat window = in(roi);
-            cv::Mat aux = window.mul(filter);
+            const float *src = in.ptr<float>(k);
+            for (int x = 0; x < in.cols; ++x)
+                col_sum[x] += src[x];
+        }
+        for (int y = rows.start; y < rows.end; ++y)
+        {
+            if (y > rows.start)
+            {
+                const float *enter = in.ptr<float>(y + ksize - 1);
+                const float *leave = in.ptr<float>(y - 1);
+                for (int x = 0; x < in.cols; ++x)
+                    col_sum[x] += double(enter[x]) - leave[x];
+            }
+            float *dst = ret_v.ptr<float>(y);
+            double sum = 0.0;
+            for (int x = 0; x < ksize; ++x)
+                sum += col_sum[x];
+            dst[0] = static_cast<float>(sum * norm);
+            for (int x = 1; x < ret_v.cols; ++x)
+            {
+                sum += col_sum[x + ksize - 1] - col_sum[x - 1];
+                dst[x] = static_cast<float>(sum * norm);
+            }
+        }
+    }, nstripes);
 
-            float result = cv::sum(aux)[0];
-            ret_v.at<float>(i, j) = result;
+    CV_Assert(ret_v.type() == CV_32FC1);
+    CV_Assert(ret_v.rows == in.rows - 2 * r);
+    CV_Assert(ret_v.cols == in.cols - 2 * r);
+    return ret_v;
+}
+
+cv::Mat
+fsiv_separable_filter2D(cv::Mat const &in, cv::Mat const &kernel)
+{
+    CV_Assert(!in.empty() && in.type() == CV_32FC1);
+    CV_Assert(kernel.type() == CV_32FC1 && kernel.total() % 2 == 1);
+    CV_Assert(kernel.cols == 1 || kernel.rows == 1);
+    const int ksize = static_cast<int>(kernel.total());
+    const int r = ksize / 2;
+    CV_Assert(in.rows > 2 * r && in.cols > 2 * r);
+    const cv::Mat k = kernel.isContinuous() ? kernel : kernel.clone();
+    const float *coef = k.ptr<float>();
+
+    // Row pass: keeps every input row, removes the horizontal border.
+    cv::Mat tmp(in.rows, in.cols - 2 * r, CV_32F);
+    cv::parallel_for_(cv::Range(0, in.rows), [&](const cv::Range &rows)
+    {
+        for (int y = rows.start; y < rows.end; ++y)
+        {
+            const float *src = in.ptr<float>(y);
+            float *dst = tmp.ptr<float>(y);
+            for (int x = 0; x < tmp.cols; ++x)
+            {
+                float sum = 0.0f;
+                for (int i = 0; i < ksize; ++i)
+                    sum += coef[i] * src[x + i];
+                dst[x] = sum;
+            }
         }
-    }
+    });
+
+    // Column pass: accumulates whole rows so the inner loop is contiguous.
+    cv::Mat ret_v(in.rows - 2 * r, tmp.cols, CV_32F);
+    cv::parallel_for_(cv::Range(0, ret_v.rows), [&](const cv::Range &rows)
+    {
+        for (int y = rows.start; y < rows.end; ++y)
+        {
+            float *dst = ret_v.ptr<float>(y);
+            std::fill(dst, dst + ret_v.cols, 0.0f);
+            for (int i = 0; i < ksize; ++i)
+                accumulate_tap(tmp.ptr<float>(y + i), coef[i], dst, ret_v.cols);
+        }
+    });
 
-    //
+    CV_Assert(ret_v.type() == CV_32FC1);
+    CV_Assert(ret_v.rows == in.rows - 2 * r);
+    CV_Assert(ret_v.cols == in.cols - 2 * r);
+    return ret_v;
+}
+
+cv::Mat
+fsiv_dft_filter2D(cv::Mat const &in, cv::Mat const &filter)
+{
+    CV_Assert(!in.empty() && !filter.empty());
+    CV_Assert(in.type() == CV_32FC1 && filter.type() == CV_32FC1);
+    CV_Assert(in.rows >= filter.rows && in.cols >= filter.cols);
+    const cv::Mat spectrum = filter_spectrum(filter, optimal_dft_size(in.size()));
+    cv::Mat padded = cv::Mat::zeros(spectrum.size(), CV_32F);
+    in.copyTo(padded(cv::Rect(0, 0, in.cols, in.rows)));
+    cv::Mat ret_v = dft_correlate(
+        padded, in.rows, spectrum,
+        cv::Size(in.cols - 2 * (filter.cols / 2), in.rows - 2 * (filter.rows / 2))).clone();
     CV_Assert(ret_v.type() == CV_32FC1);
     CV_Assert(ret_v.rows == in.rows - 2 * (filter.rows / 2));
     CV_Assert(ret_v.cols == in.cols - 2 * (filter.cols / 2));
     return ret_v;
 }
 
+ConvCostModel
+fsiv_get_conv_cost_model()
+{
+    return cost_model;
+}
+
+void fsiv_set_conv_cost_model(ConvCostModel const &model)
+{
+    CV_Assert(model.direct_tap > 0.0 && model.separable_tap > 0.0 &&
+              model.dft_point > 0.0);
+    cost_model = model;
+}
+
+int fsiv_choose_conv_backend(cv::Size size, int r, int filter_type)
+{
+    CV_Assert(size.area() > 0 && r > 0);
+    CV_Assert(filter_type >= 0 && filter_type <= 1);
+    const double pixels = static_cast<double>(size.area());
+    const double ksize = 2.0 * r + 1.0;
+    const cv::Size dft_size = optimal_dft_size(size + cv::Size(2 * r, 2 * r));
+    const double points = static_cast<double>(dft_size.area());
+
+    const double cost[3] = {
+        cost_model.direct_tap * pixels * ksize * ksize,
+        cost_model.separable_tap * pixels * (filter_type == 0 ? 4.0 : 2.0 * ksize),
+        cost_model.dft_point * points * std::log2(points)};
+    return static_cast<int>(std::min_element(cost, cost + 3) - cost);
+}
+
+cv::Mat
+fsiv_usm_blur(cv::Mat const &in, int r, int filter_type, int backend)
+{
+    CV_Assert(!in.empty() && in.type() == CV_32FC1);
+    CV_Assert(r > 0 && in.rows > 2 * r && in.cols > 2 * r);
+    CV_Assert(filter_type >= 0 && filter_type <= 1);
+    CV_Assert(backend >= FSIV_CONV_AUTO && backend <= FSIV_CONV_DFT);
+    if (backend == FSIV_CONV_AUTO)
+        backend = fsiv_choose_conv_backend(
+            in.size() - cv::Size(2 * r, 2 * r), r, filter_type);
+
+    cv::Mat ret_v;
+    if (backend == FSIV_CONV_DIRECT)
+        ret_v = fsiv_filter2D(in, filter_type == 0 ? fsiv_create_box_filter(r)
+                                                   : fsiv_create_gaussian_filter(r));
+    else if (backend == FSIV_CONV_SEPARABLE)
+        ret_v = filter_type == 0 ? fsiv_box_filter(in, r)
+                                 : fsiv_separable_filter2D(in, fsiv_create_gaussian_kernel_1d(r));
+    else
+    {
+        const cv::Mat &spectrum = usm_filter_spectrum(r, filter_type,
+                                                      optimal_dft_size(in.size()));
+        cv::Mat padded = cv::Mat::zeros(spectrum.size(), CV_32F);
+        in.copyTo(padded(cv::Rect(0, 0, in.cols, in.rows)));
+        ret_v = dft_correlate(padded, in.rows, spectrum,
+                              in.size() - cv::Size(2 * r, 2 * r)).clone();
+    }
+
+    CV_Assert(ret_v.type() == CV_32FC1);
+    CV_Assert(ret_v.rows == in.rows - 2 * r);
+    CV_Assert(ret_v.cols == in.cols - 2 * r);
+    return ret_v;
+}
+
+namespace
+{
+
+// Body of fsiv_blur(), with an optional fused unsharp combine.
+cv::Mat
+blur_virtual_border(cv::Mat const &in, int r, int filter_type, bool circular,
+                    int backend, UsmCombine const *combine)
+{
+    if (backend == FSIV_CONV_AUTO)
+        backend = fsiv_choose_conv_backend(in.size(), r, filter_type);
+
+    if (backend == FSIV_CONV_DIRECT)
+        return filter2D_virtual_border(
+            in, filter_type == 0 ? fsiv_create_box_filter(r) : fsiv_create_gaussian_filter(r),
+            circular, combine);
+    if (backend == FSIV_CONV_SEPARABLE)
+        return filter_type == 0
+                   ? box_filter_virtual_border(in, r, circular, combine)
+                   : separable_filter2D_virtual_border(
+                         in, fsiv_create_gaussian_kernel_1d(r), circular, combine);
+
+    // The DFT needs a padded buffer anyway, so the border is built
+    // directly inside it instead of in a separate expanded image.
+    const cv::Size expanded_size = in.size() + cv::Size(2 * r, 2 * r);
+    const cv::Mat &spectrum = usm_filter_spectrum(r, filter_type,
+                                                  optimal_dft_size(expanded_size));
+    cv::Mat padded = cv::Mat::zeros(spectrum.size(), CV_32F);
+    cv::Mat expanded = padded(cv::Rect(cv::Point(0, 0), expanded_size));
+    cv::copyMakeBorder(in, expanded, r, r, r, r,
+                       circular ? cv::BORDER_WRAP : cv::BORDER_CONSTANT);
+    const cv::Mat blur = dft_correlate(padded, expanded_size.height, spectrum,
+                                       in.size());
+    if (combine == nullptr)
+        return blur.clone();
+    combine->out->create(in.size(), CV_32F);
+    cv::parallel_for_(cv::Range(0, in.rows), [&](const cv::Range &rows)
+    {
+        for (int y = rows.start; y < rows.end; ++y)
+            finish_row(combine, y, blur.ptr<float>(y));
+    });
+    return combine->keep_blur ? blur.clone() : cv::Mat();
+}
+
+} // namespace
+
+cv::Mat
+fsiv_blur(cv::Mat const &in, int r, int filter_type, bool circular,
+          int backend)
+{
+    CV_Assert(!in.empty() && in.type() == CV_32FC1);
+    CV_Assert(r > 0);
+    CV_Assert(filter_type >= 0 && filter_type <= 1);
+    CV_Assert(backend >= FSIV_CONV_AUTO && backend <= FSIV_CONV_DFT);
+    cv::Mat ret_v = blur_virtual_border(in, r, filter_type, circular, backend,
+                                        nullptr);
+    CV_Assert(ret_v.type() == CV_32FC1);
+    CV_Assert(ret_v.size() == in.size());
+    return ret_v;
+}
+
 cv::Mat
 fsiv_combine_images(const cv::Mat src1, const cv::Mat src2,
                     double a, double b)
@@ -154,7 +981,8 @@ fsiv_combine_images(const cv::Mat src1, const cv::Mat src2,
 
 cv::Mat
 fsiv_usm_enhance(cv::Mat const &in, double g, int r,
-                 int filter_type, bool circular, cv::Mat *unsharp_mask)
+                 int filter_type, bool circular, cv::Mat *unsharp_mask,
+                 int backend)
 {
     CV_Assert(!in.empty());
     CV_Assert(in.type() == CV_32FC1);
@@ -167,36 +995,255 @@ fsiv_usm_enhance(cv::Mat const &in, double g, int r,
     // Remember: when unsharp_mask pointer is nullptr, means don't save the
     //           unsharp mask on int.
 
-    cv::Mat filter;
-    cv::Mat expanded_input;
+    // The border is handled virtually by the convolution engine, so no
+    // expanded copy of the input is allocated, and the engine combines each
+    // row with the input as soon as it is blurred. The low frequency image is
+    // only kept when the unsharp mask is requested.
+    CV_Assert(backend >= FSIV_CONV_AUTO && backend <= FSIV_CONV_DFT);
+    const UsmCombine combine = {&in, &ret_v, static_cast<float>(g),
+                                unsharp_mask != nullptr, 0.0f};
+    cv::Mat input_low_frequency = blur_virtual_border(in, r, filter_type,
+                                                      circular, backend,
+                                                      &combine);
+
+    if (unsharp_mask != nullptr)
+    {
+        *unsharp_mask = input_low_frequency;
+    }
+
+    //
+    CV_Assert(ret_v.rows == in.rows);
+    CV_Assert(ret_v.cols == in.cols);
+    CV_Assert(ret_v.type() == CV_32FC1);
+    return ret_v;
+}
+
+cv::Mat
+fsiv_extract_luma(cv::Mat const &in)
+{
+    CV_Assert(!in.empty() && in.type() == CV_8UC3);
+    cv::Mat ret_v(in.rows, in.cols, CV_32F);
+    cv::parallel_for_(cv::Range(0, in.rows), [&](const cv::Range &rows)
+    {
+        for (int y = rows.start; y < rows.end; ++y)
+            bgr_to_luma_row(in.ptr<uchar>(y), ret_v.ptr<float>(y), in.cols);
+    });
+    CV_Assert(ret_v.type() == CV_32FC1);
+    CV_Assert(ret_v.size() == in.size());
+    return ret_v;
+}
+
+cv::Mat
+fsiv_usm_enhance_bgr(cv::Mat const &in, double g, int r,
+                     int filter_type, bool circular, cv::Mat *unsharp_mask,
+                     int backend)
+{
+    CV_Assert(!in.empty());
+    CV_Assert(in.type() == CV_8UC3);
+    CV_Assert(r > 0);
+    CV_Assert(filter_type >= 0 && filter_type <= 1);
+    CV_Assert(g >= 0.0);
+
+    const cv::Mat luma = fsiv_extract_luma(in);
+    const cv::Mat blur = fsiv_blur(luma, r, filter_type, circular, backend);
+    // The luma is in [0, 1], so the enhance is scaled back to [0, 255].
+    const float k = static_cast<float>(g * 255.0);
+    cv::Mat ret_v(in.rows, in.cols, CV_8UC3);
+    cv::parallel_for_(cv::Range(0, in.rows), [&](const cv::Range &rows)
+    {
+        for (int y = rows.start; y < rows.end; ++y)
+            add_luma_detail_row(in.ptr<uchar>(y), luma.ptr<float>(y),
+                                blur.ptr<float>(y), k, ret_v.ptr<uchar>(y),
+                                in.cols);
+    });
+    if (unsharp_mask != nullptr)
+        *unsharp_mask = blur;
 
-    if (filter_type == 0)
+    CV_Assert(ret_v.rows == in.rows);
+    CV_Assert(ret_v.cols == in.cols);
+    CV_Assert(ret_v.type() == CV_8UC3);
+    return ret_v;
+}
+
+cv::Mat
+fsiv_multiscale_usm_enhance(cv::Mat const &in, std::vector<int> const &radii,
+                            std::vector<double> const &gains, bool circular,
+                            cv::Mat *unsharp_mask, int backend)
+{
+    CV_Assert(!in.empty());
+    CV_Assert(in.type() == CV_32FC1);
+    CV_Assert(!radii.empty() && radii.size() == gains.size());
+    CV_Assert(radii[0] > 0);
+    for (size_t k = 0; k < radii.size(); ++k)
     {
-        filter = fsiv_create_box_filter(r);
+        CV_Assert(k == 0 || radii[k] > radii[k - 1]);
+        CV_Assert(gains[k] >= 0.0);
     }
-    else if (filter_type == 1)
+
+    // Decimated Gaussian pyramid. Reducing to level l and expanding back adds
+    // a variance of 2(4^l-1)/3 pixels, so each scale is blurred at the
+    // deepest level where the variance left is still at least one pixel of
+    // that level, with the radius whose sigma gives it. That radius is at
+    // most 7, and a blur at level l costs 4^-l of one at full resolution.
+    const int n = static_cast<int>(radii.size());
+    std::vector<int> level(n, 0);
+    std::vector<int> level_r(radii);
+    int depth = 0;
+    for (int k = 0; k < n; ++k)
     {
-        filter = fsiv_create_gaussian_filter(r);
+        const double s = gaussian_sigma(radii[k]);
+        cv::Size size = in.size();
+        for (int l = 1;; ++l)
+        {
+            const double scale = std::ldexp(1.0, 2 * l);
+            const double v = (s * s - 2.0 * (scale - 1.0) / 3.0) / scale;
+            size = cv::Size((size.width + 1) / 2, (size.height + 1) / 2);
+            if (v < 1.0 || std::min(size.width, size.height) < PYR_MIN_SIZE)
+                break;
+            level[k] = l;
+            level_r[k] = std::max(1, cvRound((std::sqrt(v) - 0.8) / 0.3) + 1);
+        }
+        depth = std::max(depth, level[k]);
     }
+    std::vector<cv::Mat> pyramid(depth + 1);
+    pyramid[0] = in;
+    for (int l = 1; l <= depth; ++l)
+        pyramid[l] = pyramid_down(pyramid[l - 1], circular);
 
-    if (circular)
+    // Band sum, sum g_k * blur_k, accumulated in place from the coarsest
+    // level upwards, so it is expanded once per level whatever the number of
+    // scales.
+    cv::Mat band_sum;
+    cv::Mat mask;
+    int mask_level = 0;
+    for (int l = depth; l >= 0; --l)
     {
-        expanded_input = fsiv_circular_expansion(in, r);
+        if (band_sum.empty())
+            band_sum = cv::Mat::zeros(pyramid[l].size(), CV_32F);
+        else
+            band_sum = pyramid_up(band_sum, pyramid[l].size(), circular);
+        for (int k = 0; k < n; ++k)
+        {
+            if (level[k] != l)
+                continue;
+            const cv::Mat blur = fsiv_blur(pyramid[l], level_r[k], 1, circular,
+                                           backend);
+            const float gain = static_cast<float>(gains[k]);
+            cv::parallel_for_(cv::Range(0, blur.rows), [&](const cv::Range &rows)
+            {
+                for (int y = rows.start; y < rows.end; ++y)
+                    accumulate_tap(blur.ptr<float>(y), gain,
+                                   band_sum.ptr<float>(y), blur.cols);
+            });
+            if (k == n - 1)
+            {
+                mask = blur;
+                mask_level = l;
+            }
+        }
     }
-    else 
+
+    // Final pass: ret = (1 + sum g_k) * in - sum g_k * blur_k.
+    double total_gain = 0.0;
+    for (int k = 0; k < n; ++k)
+        total_gain += gains[k];
+    cv::Mat ret_v(in.rows, in.cols, CV_32F);
+    cv::parallel_for_(cv::Range(0, in.rows), [&](const cv::Range &rows)
+    {
+        for (int y = rows.start; y < rows.end; ++y)
+        {
+            float *dst = ret_v.ptr<float>(y);
+            std::fill(dst, dst + in.cols, 0.0f);
+            accumulate_tap(in.ptr<float>(y), static_cast<float>(1.0 + total_gain),
+                           dst, in.cols);
+            accumulate_tap(band_sum.ptr<float>(y), -1.0f, dst, in.cols);
+        }
+    });
+    if (unsharp_mask != nullptr)
     {
-        expanded_input = fsiv_fill_expansion(in, r);
+        for (int l = mask_level; l > 0; --l)
+            mask = pyramid_up(mask, pyramid[l - 1].size(), circular);
+        *unsharp_mask = mask;
     }
 
-    cv::Mat input_low_frequency = fsiv_filter2D(expanded_input, filter);
-    ret_v = fsiv_combine_images(in, input_low_frequency, g + 1, -g);
+    CV_Assert(ret_v.rows == in.rows);
+    CV_Assert(ret_v.cols == in.cols);
+    CV_Assert(ret_v.type() == CV_32FC1);
+    return ret_v;
+}
 
-    if (unsharp_mask != nullptr)
+void fsiv_usm_enhance_stream(cv::Size size, FsivRowReader const &read,
+                             FsivRowWriter const &write, double g, int r,
+                             int filter_type, int band_rows, int backend)
+{
+    CV_Assert(size.width > 0 && size.height > 0);
+    CV_Assert(g >= 0.0);
+    CV_Assert(r > 0);
+    CV_Assert(filter_type >= 0 && filter_type <= 1);
+    CV_Assert(band_rows > 0);
+
+    // The window keeps r zero columns at each side and r rows above and
+    // below the band, which are zero outside the image.
+    const int band = std::min(band_rows, size.height);
+    cv::Mat window = cv::Mat::zeros(band + 2 * r, size.width + 2 * r, CV_32F);
+    int next_row = 0;
+    auto fill = [&](int first, int n)
     {
-        *unsharp_mask = input_low_frequency;
+        const int available = std::min(n, size.height - next_row);
+        if (available > 0)
+        {
+            cv::Mat rows = window(cv::Rect(r, first, size.width, available));
+            read(rows);
+            // The reader must fill the view, not reallocate it.
+            CV_Assert(rows.ptr<float>() == window.ptr<float>(first) + r);
+            next_row += available;
+        }
+        if (available < n)
+            window.rowRange(first + available, first + n).setTo(0.0);
+    };
+
+    fill(r, band + r);
+    for (int y = 0; y < size.height;)
+    {
+        const int n = std::min(band, size.height - y);
+        const cv::Mat blur = fsiv_usm_blur(window.rowRange(0, n + 2 * r), r,
+                                           filter_type, backend);
+        write(fsiv_combine_images(window(cv::Rect(r, r, size.width, n)), blur,
+                                  g + 1, -g));
+        y += n;
+        if (y < size.height)
+        {
+            // The last 2r rows of the window are the top of the next one.
+            window.rowRange(n, n + 2 * r).clone().copyTo(window.rowRange(0, 2 * r));
+            fill(2 * r, band);
+        }
     }
+}
+
+cv::Mat
+fsiv_adaptive_usm_enhance(cv::Mat const &in, double g, int r, double threshold,
+                          int filter_type, bool circular,
+                          cv::Mat *unsharp_mask, int backend)
+{
+    CV_Assert(!in.empty());
+    CV_Assert(in.type() == CV_32FC1);
+    CV_Assert(r > 0);
+    CV_Assert(filter_type >= 0 && filter_type <= 1);
+    CV_Assert(backend >= FSIV_CONV_AUTO && backend <= FSIV_CONV_DFT);
+    CV_Assert(g >= 0.0);
+    CV_Assert(threshold >= 0.0);
+
+    // The per pixel gain is computed in the row loop of the blur engine, so
+    // the adaptive enhance costs the same as the plain one.
+    cv::Mat ret_v;
+    const UsmCombine combine = {&in, &ret_v, static_cast<float>(g),
+                                unsharp_mask != nullptr,
+                                static_cast<float>(threshold)};
+    cv::Mat blur = blur_virtual_border(in, r, filter_type, circular, backend,
+                                       &combine);
+    if (unsharp_mask != nullptr)
+        *unsharp_mask = blur;
 
-    //
     CV_Assert(ret_v.rows == in.rows);
     CV_Assert(ret_v.cols == in.cols);
     CV_Assert(ret_v.type() == CV_32FC1);
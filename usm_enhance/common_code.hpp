@@ -9,6 +9,8 @@
  *
  */
 #pragma once
+#include <functional>
+#include <vector>
 #include <opencv2/core.hpp>
 
 /**
@@ -33,6 +35,18 @@ cv::Mat fsiv_create_box_filter(const int r);
  */
 cv::Mat fsiv_create_gaussian_filter(const int r);
 
+/**
+ * @brief Return the 1-D Gaussian kernel used by fsiv_create_gaussian_filter.
+ * The 2-D Gaussian filter is the outer product of this kernel with itself.
+ * @arg[in] r is the filter's radius.
+ * @return the kernel as a column vector.
+ * @pre r>0;
+ * @post ret_v.type()==CV_32FC1
+ * @post retV.rows==2*r+1 && retV.cols==1
+ * @post (abs(cv::sum(retV)-1.0)<1.0e-6
+ */
+cv::Mat fsiv_create_gaussian_kernel_1d(const int r);
+
 /**
  * @brief Expand an image with zero padding.
  * @arg[in] in is the input image.
@@ -72,6 +86,150 @@ cv::Mat fsiv_circular_expansion(cv::Mat const &in, const int r);
  */
 cv::Mat fsiv_filter2D(cv::Mat const &in, cv::Mat const &filter);
 
+/**
+ * @brief Box filter an expanded image using running sums.
+ * The result is the same as fsiv_filter2D(in, fsiv_create_box_filter(r)) but
+ * each output pixel costs O(1) whatever the radius is: the column sums of the
+ * window are updated adding the row that enters and subtracting the row that
+ * leaves, and the row sum is slid in the same way over the column sums.
+ * @arg[in] in is the input image, already expanded r pixels per side.
+ * @arg[in] r is the filter's radius.
+ * @pre !in.empty() && in.type()==CV_32FC1
+ * @pre r>0 && in.rows>2*r && in.cols>2*r
+ * @post ret.type()==CV_32FC1
+ * @post ret.rows == in.rows-2*r
+ * @post ret.cols == in.cols-2*r
+ */
+cv::Mat fsiv_box_filter(cv::Mat const &in, const int r);
+
+/**
+ * @brief Correlate an expanded image with a separable filter.
+ * The filter is kernel*kernel.t(), applied as a row pass followed by a column
+ * pass, so each output pixel costs O(r) instead of O(r^2).
+ * @arg[in] in is the input image, already expanded kernel.rows/2 pixels per side.
+ * @arg[in] kernel is the 1-D kernel, with an odd number of coefficients.
+ * @pre !in.empty() && in.type()==CV_32FC1
+ * @pre kernel.type()==CV_32FC1 && kernel.total()%2==1
+ * @pre kernel.cols==1 || kernel.rows==1
+ * @post ret.type()==CV_32FC1
+ * @post ret.rows == in.rows-2*(kernel.total()/2)
+ * @post ret.cols == in.cols-2*(kernel.total()/2)
+ */
+cv::Mat fsiv_separable_filter2D(cv::Mat const &in, cv::Mat const &kernel);
+
+/**
+ * @brief Correlate an image with a filter in the frequency domain.
+ * The image and the filter are zero padded to the size given by
+ * cv::getOptimalDFTSize(), and the product of the image spectrum with the
+ * conjugated filter spectrum is transformed back. The result is the same as
+ * fsiv_filter2D() within float round-off, but its cost does not depend on the
+ * filter's size.
+ * @arg[in] in is the input image.
+ * @arg[in] filter is the filter to be applied.
+ * @pre !in.empty() && !filter.empty()
+ * @pre in.type()==CV_32FC1 && filter.type()==CV_32FC1.
+ * @pre in.rows>=filter.rows && in.cols>=filter.cols
+ * @post ret.type()==CV_32FC1
+ * @post ret.rows == in.rows-2*(filters.rows/2)
+ * @post ret.cols == in.cols-2*(filters.cols/2)
+ */
+cv::Mat fsiv_dft_filter2D(cv::Mat const &in, cv::Mat const &filter);
+
+/**
+ * @brief Convolution backends used to compute the unsharp mask.
+ * FSIV_CONV_DIRECT correlates with the dense kernel (fsiv_filter2D),
+ * FSIV_CONV_SEPARABLE uses running sums for the box filter and a row/column
+ * pass for the Gaussian filter, FSIV_CONV_DFT uses fsiv_dft_filter2D and
+ * FSIV_CONV_AUTO chooses the cheapest one with the cost model.
+ */
+const int FSIV_CONV_AUTO = -1;
+const int FSIV_CONV_DIRECT = 0;
+const int FSIV_CONV_SEPARABLE = 1;
+const int FSIV_CONV_DFT = 2;
+
+/**
+ * @brief Cost model used to choose the convolution backend.
+ * The estimated time of each backend, in nanoseconds, is:
+ *   direct: direct_tap * pixels * (2r+1)^2
+ *   separable: separable_tap * pixels * (box ? 4 : 2*(2r+1))
+ *   DFT: dft_point * M*N * log2(M*N), with MxN the padded DFT size.
+ * The defaults were fitted on one thread of an Intel Xeon server. Fit them
+ * for another machine with bench_usm_enhance, which prints them in the
+ * format of the -k option of usm_enhance.
+ */
+struct ConvCostModel
+{
+    double direct_tap;
+    double separable_tap;
+    double dft_point;
+};
+
+/**
+ * @brief Get the cost model used by FSIV_CONV_AUTO.
+ */
+ConvCostModel fsiv_get_conv_cost_model();
+
+/**
+ * @brief Set the cost model used by FSIV_CONV_AUTO.
+ * @pre model.direct_tap>0 && model.separable_tap>0 && model.dft_point>0
+ */
+void fsiv_set_conv_cost_model(ConvCostModel const &model);
+
+/**
+ * @brief Choose the cheapest convolution backend for a blur.
+ * @arg[in] size is the size of the image to be blurred (without expansion).
+ * @arg[in] r is the window's radius.
+ * @arg[in] filter_type specifies which filter to use. 0->Box, 1->Gaussian.
+ * @return one of FSIV_CONV_DIRECT, FSIV_CONV_SEPARABLE, FSIV_CONV_DFT.
+ * @pre size.area()>0 && r>0
+ * @pre filter_type is {0, 1}
+ */
+int fsiv_choose_conv_backend(cv::Size size, int r, int filter_type);
+
+/**
+ * @brief Compute the low pass image of the unsharp mask.
+ * The DFT backend caches the filter spectrum for the last (r, filter_type,
+ * image size) used by the calling thread, so repeated calls with the same
+ * geometry (i.e. changing only the gain) only transform the image.
+ * @arg[in] in is the input image, already expanded r pixels per side.
+ * @arg[in] r is the window's radius.
+ * @arg[in] filter_type specifies which filter to use. 0->Box, 1->Gaussian.
+ * @arg[in] backend is FSIV_CONV_AUTO or the backend to be used.
+ * @pre !in.empty() && in.type()==CV_32FC1
+ * @pre r>0 && in.rows>2*r && in.cols>2*r
+ * @pre filter_type is {0, 1}
+ * @pre backend is {FSIV_CONV_AUTO, FSIV_CONV_DIRECT, FSIV_CONV_SEPARABLE, FSIV_CONV_DFT}
+ * @post ret.type()==CV_32FC1
+ * @post ret.rows == in.rows-2*r
+ * @post ret.cols == in.cols-2*r
+ */
+cv::Mat fsiv_usm_blur(cv::Mat const &in, int r, int filter_type,
+                      int backend = FSIV_CONV_AUTO);
+
+/**
+ * @brief Compute the low pass image of the unsharp mask without expanding
+ * the input.
+ * The border is virtual: the direct and separable engines correlate the
+ * interior of each row as contiguous runs and handle the r border samples as
+ * zeros (skipped) or as runs wrapped around to the opposite side, so no
+ * padded image is allocated. The DFT engine builds the border inside the
+ * padded buffer it needs anyway.
+ * The result is the same as fsiv_usm_blur() of the expanded input.
+ * @arg[in] in is the input image.
+ * @arg[in] r is the window's radius.
+ * @arg[in] filter_type specifies which filter to use. 0->Box, 1->Gaussian.
+ * @arg[in] circular if it is true, use circular expansion, else zero padding.
+ * @arg[in] backend is FSIV_CONV_AUTO or the backend to be used.
+ * @pre !in.empty() && in.type()==CV_32FC1
+ * @pre r>0
+ * @pre filter_type is {0, 1}
+ * @pre backend is {FSIV_CONV_AUTO, FSIV_CONV_DIRECT, FSIV_CONV_SEPARABLE, FSIV_CONV_DFT}
+ * @post ret.type()==CV_32FC1
+ * @post ret.size()==in.size()
+ */
+cv::Mat fsiv_blur(cv::Mat const &in, int r, int filter_type, bool circular,
+                  int backend = FSIV_CONV_AUTO);
+
 /**
  * @brief Combine two images using weigths.
  * @param src1 first image.
@@ -96,6 +254,7 @@ cv::Mat fsiv_combine_images(const cv::Mat src1, const cv::Mat src2,
  * @arg[in] filter_type specifies which filter to use. 0->Box, 1->Gaussian.
  * @arg[in] circular specifies if it is true, it be used circular expansion to do the convolution, else it is used zero padding.
  * @arg[out] unsharp_mask if it is not nullptr, save the unsharp mask used.
+ * @arg[in] backend is the convolution backend (see fsiv_usm_blur).
  * @pre !in.empty()
  * @pre in.type()==CV_32FC1
  * @pre g>=0.0
@@ -106,4 +265,162 @@ cv::Mat fsiv_combine_images(const cv::Mat src1, const cv::Mat src2,
  */
 cv::Mat fsiv_usm_enhance(cv::Mat const &in, double g = 1.0, int r = 1,
                          int filter_type = 0, bool circular = false,
-                         cv::Mat *unsharp_mask = nullptr);
+                         cv::Mat *unsharp_mask = nullptr,
+                         int backend = FSIV_CONV_AUTO);
+
+/**
+ * @brief Extract the luma of a BGR image.
+ * The luma is the Y channel of the YCrCb color space,
+ * Y = 0.299 R + 0.587 G + 0.114 B, scaled to [0, 1].
+ * @arg[in] in is the input image.
+ * @return the luma image.
+ * @pre !in.empty() && in.type()==CV_8UC3
+ * @post ret_v.type()==CV_32FC1
+ * @post ret_v.size()==in.size()
+ */
+cv::Mat fsiv_extract_luma(cv::Mat const &in);
+
+/**
+ * @brief Apply an unsharp mask enhance to the luma of a 8-bit BGR image.
+ * The luma is extracted in one pass (see fsiv_extract_luma), blurred, and the
+ * enhance Y' - Y = g*(Y - blur(Y)) is added to the three channels in a second
+ * pass. Adding the same amount to B, G and R keeps Cr and Cb unchanged, so
+ * this sharpens the YCrCb luma without any color space round trip.
+ * @note Sharpening Y instead of the HSV V channel gives slightly different
+ * results on saturated colors, where V is the largest channel.
+ * @arg[in] in is the input image.
+ * @arg[in] g is the enhance's gain.
+ * @arg[in] r is the window's radius.
+ * @arg[in] filter_type specifies which filter to use. 0->Box, 1->Gaussian.
+ * @arg[in] circular specifies if it is true, it be used circular expansion to do the convolution, else it is used zero padding.
+ * @arg[out] unsharp_mask if it is not nullptr, save the unsharp mask (the
+ * blurred luma, CV_32FC1) used.
+ * @arg[in] backend is the convolution backend (see fsiv_usm_blur).
+ * @pre !in.empty()
+ * @pre in.type()==CV_8UC3
+ * @pre g>=0.0
+ * @pre r>0
+ * @pre filter_type is {0, 1}
+ * @post ret_v.rows==in.rows && ret_v.cols==in.cols
+ * @post ret_v.type()==CV_8UC3
+ */
+cv::Mat fsiv_usm_enhance_bgr(cv::Mat const &in, double g = 1.0, int r = 1,
+                             int filter_type = 0, bool circular = false,
+                             cv::Mat *unsharp_mask = nullptr,
+                             int backend = FSIV_CONV_AUTO);
+
+/**
+ * @brief Apply a multi-scale unsharp mask enhance to the input image.
+ * The result is the sum of the unsharp masks of every scale,
+ *   ret = in + sum_k gains[k] * (in - blur_k),
+ * where blur_k is the Gaussian blur of radius radii[k]. The blurs run on a
+ * decimated Gaussian pyramid: a scale is blurred at the deepest level where
+ * the reduce and expand filters leave a sigma of at least one pixel, with a
+ * radius of at most 7 pixels of that level. The band sum is accumulated from
+ * the coarsest level upwards, expanding it once per level, and combined with
+ * the input in one final pass. A blur at level l costs 4^-l of one at full
+ * resolution, so the cost is a few passes over the image plus the blurs of
+ * the scales with sigma below 2.45 (radius below 7), which stay at full
+ * resolution, instead of growing with the largest radius.
+ * @note The scales blurred on a reduced level only approximate the Gaussian
+ * of radius radii[k]: their radius is rounded and the decimation aliases a
+ * little, so they differ slightly from a direct blur. The full resolution
+ * scales are exactly fsiv_blur().
+ * @arg[in] in is the input image.
+ * @arg[in] radii are the radii of the scales, in increasing order.
+ * @arg[in] gains are the enhance's gains of the scales.
+ * @arg[in] circular specifies if it is true, it be used circular expansion to do the convolution, else it is used zero padding.
+ * @arg[out] unsharp_mask if it is not nullptr, save the blur of the largest scale.
+ * @arg[in] backend is the convolution backend of the blurs (see fsiv_usm_blur).
+ * @pre !in.empty()
+ * @pre in.type()==CV_32FC1
+ * @pre !radii.empty() && radii.size()==gains.size()
+ * @pre radii[0]>0 && radii[k]>radii[k-1]
+ * @pre gains[k]>=0.0
+ * @post ret_v.rows==in.rows && ret_v.cols==in.cols
+ * @post ret_v.type()==CV_32FC1
+ */
+cv::Mat fsiv_multiscale_usm_enhance(cv::Mat const &in,
+                                    std::vector<int> const &radii,
+                                    std::vector<double> const &gains,
+                                    bool circular = false,
+                                    cv::Mat *unsharp_mask = nullptr,
+                                    int backend = FSIV_CONV_AUTO);
+
+/**
+ * @brief Read the next rows of an image.
+ * The argument is a CV_32FC1 matrix, with as many rows as rows must be read
+ * and the image's width, that must be filled with the next image's rows. It
+ * can be a non continuous view, so copy the rows into it with copyTo() or
+ * row pointers.
+ */
+typedef std::function<void(cv::Mat &rows)> FsivRowReader;
+
+/**
+ * @brief Write the next rows of an image.
+ * The argument is a CV_32FC1 matrix with the next rows of the image.
+ */
+typedef std::function<void(cv::Mat const &rows)> FsivRowWriter;
+
+/**
+ * @brief Apply an unsharp mask enhance streaming the image in row bands.
+ * The image is read in bands of band_rows rows with a window of r rows
+ * above and below them, each band is enhanced and written, and the window
+ * slides down keeping the last 2r rows read. Only the window, of
+ * (band_rows+2r)x(cols+2r) floats, and the blur and output of one band are in
+ * memory, so peak memory is O(cols*band_rows) instead of O(rows*cols).
+ * The result is the same as fsiv_usm_enhance() with zero padding.
+ * @note Circular expansion is not supported because the first rows need the
+ * last ones. The unsharp mask is not returned.
+ * @arg[in] size is the image's size.
+ * @arg[in] read is called to read the image's rows in order.
+ * @arg[in] write is called with the output's rows in order.
+ * @arg[in] g is the enhance's gain.
+ * @arg[in] r is the window's radius.
+ * @arg[in] filter_type specifies which filter to use. 0->Box, 1->Gaussian.
+ * @arg[in] band_rows is the number of rows enhanced at once.
+ * @arg[in] backend is the convolution backend (see fsiv_usm_blur).
+ * @pre size.width>0 && size.height>0
+ * @pre g>=0.0
+ * @pre r>0
+ * @pre filter_type is {0, 1}
+ * @pre band_rows>0
+ */
+void fsiv_usm_enhance_stream(cv::Size size, FsivRowReader const &read,
+                             FsivRowWriter const &write, double g = 1.0,
+                             int r = 1, int filter_type = 0,
+                             int band_rows = 256,
+                             int backend = FSIV_CONV_AUTO);
+
+/**
+ * @brief Apply an adaptive (edge aware) unsharp mask enhance.
+ * The gain is scaled per pixel by the local contrast, measured as the
+ * amplitude of the detail d = in - blur: the output is in + g*w*d, where the
+ * weight w is 0 for |d| <= threshold, grows linearly and is 1 for
+ * |d| >= 2*threshold. So the flat regions, where the detail is only noise,
+ * are not sharpened and the edges get the full gain.
+ * The weight is computed in the same parallel row loop as the blur (see
+ * fsiv_usm_enhance()), so it costs no extra pass.
+ * @arg[in] in is the input image.
+ * @arg[in] g is the enhance's gain.
+ * @arg[in] r is the window's radius.
+ * @arg[in] threshold is the amplitude of the detail below which there is no
+ * enhance. Value 0 gives the plain unsharp mask.
+ * @arg[in] filter_type specifies which filter to use. 0->Box, 1->Gaussian.
+ * @arg[in] circular specifies if it is true, it be used circular expansion to do the convolution, else it is used zero padding.
+ * @arg[out] unsharp_mask if it is not nullptr, save the unsharp mask used.
+ * @arg[in] backend is the convolution backend (see fsiv_usm_blur).
+ * @pre !in.empty()
+ * @pre in.type()==CV_32FC1
+ * @pre g>=0.0
+ * @pre r>0
+ * @pre threshold>=0.0
+ * @pre filter_type is {0, 1}
+ * @post ret_v.rows==in.rows && ret_v.cols==in.cols
+ * @post ret_v.type()==CV_32FC1
+ */
+cv::Mat fsiv_adaptive_usm_enhance(cv::Mat const &in, double g = 1.0, int r = 1,
+                                  double threshold = 0.0, int filter_type = 0,
+                                  bool circular = false,
+                                  cv::Mat *unsharp_mask = nullptr,
+                                  int backend = FSIV_CONV_AUTO);
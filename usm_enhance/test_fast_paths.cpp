@@ -0,0 +1,386 @@
+/*!
+  Test of the fast paths of the unsharp mask functions.
+
+  Checks that the fast filtering engines give the same results as the
+  reference dense correlation fsiv_filter2D.
+*/
+
+#include <iostream>
+#include <exception>
+#include <cmath>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/core/utility.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "common_code.hpp"
+
+static int failures = 0;
+
+static void check(bool condition, const char *what)
+{
+    std::cout << (condition ? "[OK]   " : "[FAIL] ") << what << std::endl;
+    if (!condition)
+        ++failures;
+}
+
+/**
+ * @brief Original correlation: one ROI, product and sum per output pixel,
+ * used as reference.
+ */
+static cv::Mat reference_filter2D(const cv::Mat &in, const cv::Mat &filter)
+{
+    cv::Mat out(in.rows - 2 * (filter.rows / 2), in.cols - 2 * (filter.cols / 2), CV_32F);
+    for (int i = 0; i < out.rows; ++i)
+        for (int j = 0; j < out.cols; ++j)
+            out.at<float>(i, j) = static_cast<float>(
+                cv::sum(in(cv::Rect(j, i, filter.cols, filter.rows)).mul(filter))[0]);
+    return out;
+}
+
+static void test_direct_filter()
+{
+    // Odd widths so the scalar tail of the vectorized loop is also used.
+    cv::Mat in(53, 77, CV_32FC1);
+    cv::randu(in, cv::Scalar(-1.0), cv::Scalar(1.0));
+    const cv::Mat filters[] = {fsiv_create_box_filter(1),
+                               fsiv_create_gaussian_filter(3),
+                               fsiv_create_gaussian_filter(6)};
+    bool same = true;
+    for (size_t i = 0; i < sizeof(filters) / sizeof(filters[0]); ++i)
+    {
+        const cv::Mat expected = reference_filter2D(in, filters[i]);
+        const cv::Mat out = fsiv_filter2D(in, filters[i]);
+        same = same && out.size() == expected.size() &&
+               cv::norm(out, expected, cv::NORM_INF) < 1.0e-5;
+    }
+    check(same, "direct correlation matches the per pixel ROI correlation");
+
+    cv::Mat rand_filter(5, 5, CV_32FC1);
+    cv::randu(rand_filter, cv::Scalar(-1.0), cv::Scalar(1.0));
+    check(cv::norm(fsiv_filter2D(in(cv::Rect(3, 2, 61, 40)), rand_filter),
+                   reference_filter2D(in(cv::Rect(3, 2, 61, 40)), rand_filter),
+                   cv::NORM_INF) < 1.0e-5,
+          "direct correlation works on a ROI with a non symmetric filter");
+}
+
+static void test_dft_filter()
+{
+    cv::Mat in(61, 83, CV_32FC1);
+    cv::randu(in, cv::Scalar(0.0), cv::Scalar(1.0));
+    cv::Mat rand_filter(7, 7, CV_32FC1);
+    cv::randu(rand_filter, cv::Scalar(-1.0), cv::Scalar(1.0));
+    check(cv::norm(fsiv_dft_filter2D(in, rand_filter),
+                   reference_filter2D(in, rand_filter), cv::NORM_INF) < 1.0e-4,
+          "DFT correlation matches the per pixel ROI correlation");
+
+    // Every backend gives the same blur. The DFT one is called twice with
+    // the same geometry, so the second call uses the cached spectrum.
+    bool same = true;
+    const int radii[] = {2, 9};
+    for (size_t i = 0; i < sizeof(radii) / sizeof(radii[0]); ++i)
+        for (int filter_type = 0; filter_type <= 1; ++filter_type)
+        {
+            const cv::Mat expanded = fsiv_fill_expansion(in, radii[i]);
+            const cv::Mat direct = fsiv_usm_blur(expanded, radii[i], filter_type,
+                                                 FSIV_CONV_DIRECT);
+            for (int backend = FSIV_CONV_AUTO; backend <= FSIV_CONV_DFT; ++backend)
+                same = same && cv::norm(fsiv_usm_blur(expanded, radii[i], filter_type, backend),
+                                        direct, cv::NORM_INF) < 1.0e-4;
+            same = same && cv::norm(fsiv_usm_blur(expanded, radii[i], filter_type, FSIV_CONV_DFT),
+                                    direct, cv::NORM_INF) < 1.0e-4;
+        }
+    check(same, "all the convolution backends give the same blur");
+}
+
+static void test_backend_choice()
+{
+    const ConvCostModel saved = fsiv_get_conv_cost_model();
+    const cv::Size size(640, 480);
+    fsiv_set_conv_cost_model({1.0, 1.0e9, 1.0e9});
+    const bool direct = fsiv_choose_conv_backend(size, 3, 1) == FSIV_CONV_DIRECT;
+    fsiv_set_conv_cost_model({1.0e9, 1.0, 1.0e9});
+    const bool separable = fsiv_choose_conv_backend(size, 3, 1) == FSIV_CONV_SEPARABLE;
+    fsiv_set_conv_cost_model({1.0e9, 1.0e9, 1.0});
+    const bool dft = fsiv_choose_conv_backend(size, 3, 1) == FSIV_CONV_DFT;
+    fsiv_set_conv_cost_model({1.0, 1.0, 1.0});
+    const bool box = fsiv_choose_conv_backend(size, 30, 0) == FSIV_CONV_SEPARABLE;
+    fsiv_set_conv_cost_model(saved);
+    check(direct && separable && dft, "the cheapest backend of the cost model is chosen");
+    check(box, "the running sum box filter wins at large radius");
+}
+
+static void test_virtual_border()
+{
+    // Small image with odd sizes, and radii up to the image's size so the
+    // wrapped runs cover most of the rows and columns, and beyond it so the
+    // circular border wraps around the image more than once.
+    cv::Mat in(19, 37, CV_32FC1);
+    cv::randu(in, cv::Scalar(0.0), cv::Scalar(1.0));
+    const int radii[] = {1, 4, 18, 45};
+    bool same = true;
+    for (size_t i = 0; i < sizeof(radii) / sizeof(radii[0]); ++i)
+        for (int circular = 0; circular <= 1; ++circular)
+        {
+            const int r = radii[i];
+            const cv::Mat expanded = circular ? fsiv_circular_expansion(in, r)
+                                              : fsiv_fill_expansion(in, r);
+            for (int filter_type = 0; filter_type <= 1; ++filter_type)
+                for (int backend = FSIV_CONV_DIRECT; backend <= FSIV_CONV_DFT; ++backend)
+                {
+                    const cv::Mat expected = fsiv_usm_blur(expanded, r, filter_type, backend);
+                    const cv::Mat out = fsiv_blur(in, r, filter_type, circular != 0, backend);
+                    same = same && out.size() == in.size() &&
+                           cv::norm(out, expected, cv::NORM_INF) < 1.0e-4;
+                }
+        }
+    check(same, "virtual border blur matches the blur of the expanded image");
+}
+
+/**
+ * @brief Original unsharp mask: dense kernel correlated with fsiv_filter2D,
+ * used as reference.
+ */
+static cv::Mat reference_usm(const cv::Mat &in, double g, int r,
+                             int filter_type, bool circular, cv::Mat &blur)
+{
+    const cv::Mat filter = filter_type == 0 ? fsiv_create_box_filter(r)
+                                            : fsiv_create_gaussian_filter(r);
+    const cv::Mat expanded = circular ? fsiv_circular_expansion(in, r)
+                                      : fsiv_fill_expansion(in, r);
+    blur = reference_filter2D(expanded, filter);
+    return fsiv_combine_images(in, blur, g + 1, -g);
+}
+
+static void test_box_filter()
+{
+    cv::Mat in(67, 93, CV_32FC1);
+    cv::randu(in, cv::Scalar(0.0), cv::Scalar(1.0));
+    const int radii[] = {1, 2, 5, 12};
+    bool same = true;
+    for (size_t i = 0; i < sizeof(radii) / sizeof(radii[0]); ++i)
+    {
+        const cv::Mat expanded = fsiv_fill_expansion(in, radii[i]);
+        const cv::Mat expected = fsiv_filter2D(expanded, fsiv_create_box_filter(radii[i]));
+        const cv::Mat box = fsiv_box_filter(expanded, radii[i]);
+        same = same && box.size() == expected.size() &&
+               cv::norm(box, expected, cv::NORM_INF) < 1.0e-5;
+    }
+    check(same, "running sum box filter matches the dense box filter");
+}
+
+static void test_separable_filter()
+{
+    cv::Mat in(71, 58, CV_32FC1);
+    cv::randu(in, cv::Scalar(0.0), cv::Scalar(1.0));
+    const int radii[] = {1, 3, 7};
+    bool same = true;
+    for (size_t i = 0; i < sizeof(radii) / sizeof(radii[0]); ++i)
+    {
+        const cv::Mat kernel = fsiv_create_gaussian_kernel_1d(radii[i]);
+        cv::Mat outer = kernel * kernel.t();
+        same = same && cv::norm(outer, fsiv_create_gaussian_filter(radii[i]),
+                                cv::NORM_INF) < 1.0e-7;
+        const cv::Mat expanded = fsiv_circular_expansion(in, radii[i]);
+        const cv::Mat expected = fsiv_filter2D(expanded, fsiv_create_gaussian_filter(radii[i]));
+        const cv::Mat sep = fsiv_separable_filter2D(expanded, kernel);
+        same = same && sep.size() == expected.size() &&
+               cv::norm(sep, expected, cv::NORM_INF) < 1.0e-5;
+    }
+    check(same, "separable Gaussian filter matches the dense Gaussian filter");
+}
+
+static void test_usm_enhance()
+{
+    cv::Mat in(48, 64, CV_32FC1);
+    cv::randu(in, cv::Scalar(0.0), cv::Scalar(1.0));
+    bool same = true;
+    for (int filter_type = 0; filter_type <= 1; ++filter_type)
+        for (int circular = 0; circular <= 1; ++circular)
+        {
+            cv::Mat blur, mask;
+            const cv::Mat expected = reference_usm(in, 2.0, 4, filter_type,
+                                                   circular != 0, blur);
+            const cv::Mat out = fsiv_usm_enhance(in, 2.0, 4, filter_type,
+                                                 circular != 0, &mask);
+            same = same && cv::norm(out, expected, cv::NORM_INF) < 1.0e-4 &&
+                   cv::norm(mask, blur, cv::NORM_INF) < 1.0e-5;
+        }
+    check(same, "usm enhance matches the dense implementation");
+}
+
+static void test_luma_enhance()
+{
+    // Odd width so the scalar tail of the vectorized loops is also used.
+    cv::Mat in(41, 203, CV_8UC3);
+    cv::randu(in, cv::Scalar::all(0), cv::Scalar::all(256));
+    cv::Mat in_f, ycrcb;
+    in.convertTo(in_f, CV_32F, 1.0 / 255.0);
+    cv::cvtColor(in_f, ycrcb, cv::COLOR_BGR2YCrCb);
+    std::vector<cv::Mat> planes;
+    cv::split(ycrcb, planes);
+    const cv::Mat luma = fsiv_extract_luma(in);
+    check(cv::norm(luma, planes[0], cv::NORM_INF) < 1.0e-5,
+          "luma is the Y channel of YCrCb");
+
+    // Reference: enhance Y with the float engine and add the change of Y to
+    // the three channels.
+    cv::Mat mask;
+    const cv::Mat enhanced = fsiv_usm_enhance(planes[0], 1.5, 3, 1, false);
+    const cv::Mat delta = (enhanced - planes[0]) * 255.0;
+    const cv::Mat deltas[] = {delta, delta, delta};
+    cv::Mat delta3, expected;
+    cv::merge(deltas, 3, delta3);
+    in.convertTo(in_f, CV_32F);
+    cv::Mat sum = in_f + delta3;
+    sum.convertTo(expected, CV_8U);
+    const cv::Mat out = fsiv_usm_enhance_bgr(in, 1.5, 3, 1, false, &mask);
+    check(out.type() == CV_8UC3 && cv::norm(out, expected, cv::NORM_INF) <= 1.0,
+          "8-bit luma enhance matches the float enhance of Y");
+    check(mask.type() == CV_32FC1 &&
+              cv::norm(mask, fsiv_blur(luma, 3, 1, false), cv::NORM_INF) == 0.0,
+          "8-bit luma enhance returns the blurred luma as unsharp mask");
+    check(cv::norm(fsiv_usm_enhance_bgr(in, 0.0, 3, 0, true), in, cv::NORM_INF) == 0.0,
+          "8-bit luma enhance with gain 0 keeps the image");
+}
+
+static void test_multiscale()
+{
+    cv::Mat in(64, 80, CV_32FC1);
+    cv::randu(in, cv::Scalar(0.0), cv::Scalar(1.0));
+    const std::vector<int> one_radius = {3};
+    const std::vector<double> one_gain = {1.5};
+    check(cv::norm(fsiv_multiscale_usm_enhance(in, one_radius, one_gain, true),
+                   fsiv_usm_enhance(in, 1.5, 3, 1, true), cv::NORM_INF) < 1.0e-5,
+          "one scale multi-scale enhance is the Gaussian unsharp mask");
+
+    // The pyramid approximates the blurs of the large scales, radius 12 on
+    // the first reduced level and 30 on the second one, so the result is
+    // close to the sum of separate unsharp masks.
+    const std::vector<int> radii = {2, 6, 12, 30};
+    const std::vector<double> gains = {1.0, 0.5, 0.25, 0.125};
+    cv::Mat expected = in.clone();
+    for (size_t k = 0; k < radii.size(); ++k)
+        expected += gains[k] * (in - fsiv_blur(in, radii[k], 1, true));
+    cv::Mat mask;
+    const cv::Mat out = fsiv_multiscale_usm_enhance(in, radii, gains, true, &mask);
+    check(out.type() == CV_32FC1 && out.size() == in.size() &&
+              cv::norm(out, expected, cv::NORM_INF) < 0.05,
+          "multi-scale enhance is close to the sum of separate unsharp masks");
+    check(mask.size() == in.size() &&
+              cv::norm(mask, fsiv_blur(in, 30, 1, true), cv::NORM_INF) < 0.05,
+          "multi-scale unsharp mask is the blur of the largest scale");
+}
+
+static void test_stream()
+{
+    cv::Mat in(57, 45, CV_32FC1);
+    cv::randu(in, cv::Scalar(0.0), cv::Scalar(1.0));
+    // Bands smaller than the radius, not dividing the height, and larger
+    // than the image.
+    const int bands[] = {1, 5, 16, 100};
+    bool same = true;
+    for (size_t b = 0; b < sizeof(bands) / sizeof(bands[0]); ++b)
+        for (int filter_type = 0; filter_type <= 1; ++filter_type)
+        {
+            int next_row = 0;
+            cv::Mat out;
+            fsiv_usm_enhance_stream(
+                in.size(),
+                [&](cv::Mat &rows)
+                {
+                    in.rowRange(next_row, next_row + rows.rows).copyTo(rows);
+                    next_row += rows.rows;
+                },
+                [&](cv::Mat const &rows)
+                { out.push_back(rows); },
+                2.0, 4, filter_type, bands[b]);
+            same = same && next_row == in.rows && out.size() == in.size() &&
+                   cv::norm(out, fsiv_usm_enhance(in, 2.0, 4, filter_type, false),
+                            cv::NORM_INF) < 1.0e-4;
+        }
+    check(same, "streamed enhance matches the whole image enhance");
+}
+
+static void test_fused_combine()
+{
+    cv::Mat in(45, 71, CV_32FC1);
+    cv::randu(in, cv::Scalar(0.0), cv::Scalar(1.0));
+    bool same = true, same_mask = true;
+    for (int backend = FSIV_CONV_DIRECT; backend <= FSIV_CONV_DFT; ++backend)
+        for (int filter_type = 0; filter_type <= 1; ++filter_type)
+            for (int circular = 0; circular <= 1; ++circular)
+            {
+                const cv::Mat blur = fsiv_blur(in, 5, filter_type, circular != 0, backend);
+                const cv::Mat expected = fsiv_combine_images(in, blur, 3.5, -2.5);
+                cv::Mat mask;
+                const cv::Mat with_mask = fsiv_usm_enhance(in, 2.5, 5, filter_type,
+                                                           circular != 0, &mask, backend);
+                const cv::Mat without_mask = fsiv_usm_enhance(in, 2.5, 5, filter_type,
+                                                              circular != 0, nullptr, backend);
+                same = same && cv::norm(with_mask, expected, cv::NORM_INF) < 1.0e-5 &&
+                       cv::norm(without_mask, with_mask, cv::NORM_INF) == 0.0;
+                same_mask = same_mask && cv::norm(mask, blur, cv::NORM_INF) == 0.0;
+            }
+    check(same, "fused combine matches fsiv_combine_images with and without mask");
+    check(same_mask, "fused combine returns the blur as unsharp mask");
+}
+
+static void test_adaptive()
+{
+    cv::Mat in(50, 66, CV_32FC1);
+    cv::randu(in, cv::Scalar(0.0), cv::Scalar(1.0));
+    check(cv::norm(fsiv_adaptive_usm_enhance(in, 2.0, 3, 0.0, 1),
+                   fsiv_usm_enhance(in, 2.0, 3, 1), cv::NORM_INF) < 1.0e-5,
+          "adaptive enhance with threshold 0 is the plain enhance");
+
+    const double t = 0.05;
+    cv::Mat mask;
+    const cv::Mat out = fsiv_adaptive_usm_enhance(in, 2.0, 3, t, 1, true, &mask);
+    const cv::Mat d = in - fsiv_blur(in, 3, 1, true);
+    cv::Mat w = (cv::abs(d) - t) / t;
+    w = cv::max(cv::min(w, 1.0), 0.0);
+    const cv::Mat expected = in + 2.0 * w.mul(d);
+    check(cv::norm(out, expected, cv::NORM_INF) < 1.0e-5 &&
+              cv::norm(mask, fsiv_blur(in, 3, 1, true), cv::NORM_INF) == 0.0,
+          "adaptive enhance scales the gain by the detail's amplitude");
+
+    // Noise below the threshold on a flat image is not amplified.
+    cv::Mat noisy(50, 66, CV_32FC1);
+    cv::randu(noisy, cv::Scalar(0.495), cv::Scalar(0.505));
+    check(cv::norm(fsiv_adaptive_usm_enhance(noisy, 5.0, 2, 0.02, 0, true),
+                   noisy, cv::NORM_INF) == 0.0,
+          "adaptive enhance keeps flat noisy regions");
+}
+
+int main()
+{
+    int retCode = EXIT_SUCCESS;
+    try
+    {
+        test_direct_filter();
+        test_box_filter();
+        test_separable_filter();
+        test_dft_filter();
+        test_backend_choice();
+        test_virtual_border();
+        test_usm_enhance();
+        test_fused_combine();
+        test_luma_enhance();
+        test_multiscale();
+        test_stream();
+        test_adaptive();
+        if (failures > 0)
+        {
+            std::cerr << failures << " checks failed." << std::endl;
+            retCode = EXIT_FAILURE;
+        }
+    }
+    catch (std::exception &e)
+    {
+        std::cerr << "Exception: " << e.what() << std::endl;
+        retCode = EXIT_FAILURE;
+    }
+    return retCode;
+}
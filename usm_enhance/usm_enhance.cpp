@@ -9,7 +9,11 @@
  *
  */
 #include <iostream>
+#include <fstream>
 #include <exception>
+#include <sstream>
+#include <cstdlib>
+#include <vector>
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/core/utility.hpp>
@@ -24,7 +28,13 @@ const cv::String keys =
     "{r radius       |1     | Window's radius. Default 1.}"
     "{g gain         |1.0   | Enhance's gain. Default 1.0}"
     "{c circular     |      | Use circular convolution.}"
+    "{m multiscale   |      | Multi-scale Gaussian enhance, list of radius:gain, e.g. 2:1.0,8:0.5,32:0.25. Overrides r, g and f.}"
+    "{t threshold    |0.0   | Adaptive enhance: amplitude of the detail, in [0, 1], below which there is no enhance. Default 0 (off).}"
+    "{s stream       |0     | Stream a binary 8-bit PGM (P5) image in bands of this number of rows. Default 0 (off).}"
+    "{y ycrcb        |      | Color images: sharpen the YCrCb luma on the 8-bit image instead of the HSV V channel.}"
     "{f filter       |0     | Filter type: 0->Box, 1->Gaussian. Default 0.}"
+    "{b backend      |-1    | Convolution: -1->auto, 0->direct, 1->separable, 2->DFT. Default -1.}"
+    "{k cost_model   |      | Cost model of the auto backend, ns per direct tap, separable tap and DFT point, e.g. 0.18,0.42,2.1, as fitted by usm_enhance_bench. Default the built-in fit.}"
     "{@input         |<none>| input image.}"
     "{@output        |<none>| output image.}";
 
@@ -36,6 +46,7 @@ const cv::String keys =
 struct UserData
 {
     cv::Mat in;                    // input image.
+    cv::Mat in_bgr;                // 8-bit BGR input for the YCrCb luma mode.
     std::vector<cv::Mat> channels; // HSV channels.
     cv::Mat luma;                  // luma/V to be enhanced.
     cv::Mat out;                   // output image.
@@ -44,16 +55,161 @@ struct UserData
     double g;                      // Enhance's gain.
     int f;                         // filter type.
     int circular;                  // use circular expansion.
+    int backend;                   // convolution backend.
+    double threshold;              // adaptive enhance's threshold.
+    std::vector<int> ms_radii;     // multi-scale radii (empty if not used).
+    std::vector<double> ms_gains;  // multi-scale gains.
     bool interactive;              // interactive mode is activated.
 };
 
+/**
+ * @brief Parse a multi-scale description "r1:g1,r2:g2,...".
+ * @return false if the description is not valid.
+ */
+bool parse_scales(const std::string &desc, std::vector<int> &radii,
+                  std::vector<double> &gains)
+{
+    std::istringstream input(desc);
+    std::string item;
+    while (std::getline(input, item, ','))
+    {
+        std::istringstream pair(item);
+        int r = 0;
+        double g = 0.0;
+        char sep = 0;
+        if (!(pair >> r >> sep >> g) || sep != ':' || r <= 0 || g < 0.0 ||
+            (!radii.empty() && r <= radii.back()))
+            return false;
+        radii.push_back(r);
+        gains.push_back(g);
+    }
+    return !radii.empty();
+}
+
+/**
+ * @brief Parse a cost model description "direct_tap,separable_tap,dft_point".
+ * @return false if the description is not valid.
+ */
+bool parse_cost_model(const std::string &desc, ConvCostModel &model)
+{
+    std::istringstream input(desc);
+    char sep1 = 0, sep2 = 0;
+    std::string rest;
+    return (input >> model.direct_tap >> sep1 >> model.separable_tap >> sep2 >>
+            model.dft_point) &&
+           !(input >> rest) && sep1 == ',' && sep2 == ',' &&
+           model.direct_tap > 0.0 && model.separable_tap > 0.0 &&
+           model.dft_point > 0.0;
+}
+
+/**
+ * @brief Read the next header field of a PNM file, skipping comments.
+ * @return false if there are no more fields.
+ */
+bool read_pnm_field(std::istream &in, std::string &field)
+{
+    while (in >> field)
+    {
+        if (field[0] != '#')
+            return true;
+        std::getline(in, field); // rest of the comment.
+    }
+    return false;
+}
+
+/**
+ * @brief Read the header of a binary 8-bit PGM file.
+ * @return false if it is not a binary 8-bit PGM file.
+ */
+bool read_pgm_header(std::istream &in, cv::Size &size)
+{
+    std::string magic, width, height, max_value;
+    if (!read_pnm_field(in, magic) || magic != "P5" ||
+        !read_pnm_field(in, width) || !read_pnm_field(in, height) ||
+        !read_pnm_field(in, max_value) || max_value != "255")
+        return false;
+    size = cv::Size(std::atoi(width.c_str()), std::atoi(height.c_str()));
+    in.get(); // the single white space before the raster.
+    return size.width > 0 && size.height > 0;
+}
+
+/**
+ * @brief Enhance a binary PGM image streaming it in row bands, so the
+ * whole image is never in memory.
+ */
+int stream_pgm(const cv::String &input_n, const cv::String &output_n,
+               const UserData &user_data, int band_rows)
+{
+    std::ifstream input(input_n, std::ios::binary);
+    cv::Size size;
+    if (!input || !read_pgm_header(input, size))
+    {
+        std::cerr << "Error: '" << input_n << "' is not a binary 8-bit PGM image."
+                  << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::ofstream output(output_n, std::ios::binary);
+    output << "P5\n"
+           << size.width << " " << size.height << "\n255\n";
+
+    std::vector<uchar> buffer;
+    fsiv_usm_enhance_stream(
+        size,
+        [&](cv::Mat &rows)
+        {
+            buffer.resize(rows.total());
+            input.read(reinterpret_cast<char *>(buffer.data()), buffer.size());
+            if (!input)
+                CV_Error(cv::Error::StsParseError, "truncated PGM image.");
+            cv::Mat(rows.rows, rows.cols, CV_8U, buffer.data())
+                .convertTo(rows, CV_32F, 1.0 / 255.0);
+        },
+        [&](cv::Mat const &rows)
+        {
+            cv::Mat out;
+            rows.convertTo(out, CV_8U, 255.0);
+            output.write(reinterpret_cast<const char *>(out.data), out.total());
+        },
+        user_data.g, user_data.r, user_data.f, band_rows, user_data.backend);
+    if (!output)
+    {
+        std::cerr << "Error: could not write output image '" << output_n
+                  << "'." << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
 /**@brief Do the gui work**/
 void do_the_work(UserData *user_data)
 {
-    user_data->out = fsiv_usm_enhance(user_data->luma, user_data->g,
-                                      user_data->r, user_data->f,
-                                      user_data->circular,
-                                      &user_data->unsharp_mask);
+    if (!user_data->in_bgr.empty())
+        user_data->out = fsiv_usm_enhance_bgr(user_data->in_bgr, user_data->g,
+                                              user_data->r, user_data->f,
+                                              user_data->circular,
+                                              &user_data->unsharp_mask,
+                                              user_data->backend);
+    else if (!user_data->ms_radii.empty())
+        user_data->out = fsiv_multiscale_usm_enhance(user_data->luma,
+                                                     user_data->ms_radii,
+                                                     user_data->ms_gains,
+                                                     user_data->circular,
+                                                     &user_data->unsharp_mask,
+                                                     user_data->backend);
+    else if (user_data->threshold > 0.0)
+        user_data->out = fsiv_adaptive_usm_enhance(user_data->luma, user_data->g,
+                                                   user_data->r,
+                                                   user_data->threshold,
+                                                   user_data->f,
+                                                   user_data->circular,
+                                                   &user_data->unsharp_mask,
+                                                   user_data->backend);
+    else
+        user_data->out = fsiv_usm_enhance(user_data->luma, user_data->g,
+                                          user_data->r, user_data->f,
+                                          user_data->circular,
+                                          &user_data->unsharp_mask,
+                                          user_data->backend);
     if (user_data->channels.size() == 3)
     {
         // Revert to BGR.
@@ -161,6 +317,49 @@ int main(int argc, char *const *argv)
             return EXIT_FAILURE;
         }
         user_data.f = parser.get<int>("f");
+        user_data.backend = parser.get<int>("b");
+        if (user_data.backend < FSIV_CONV_AUTO || user_data.backend > FSIV_CONV_DFT)
+        {
+            std::cerr << "Error: b must be in [-1, 2]." << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (parser.has("k"))
+        {
+            ConvCostModel model;
+            if (!parse_cost_model(parser.get<cv::String>("k"), model))
+            {
+                std::cerr << "Error: k must be three positive costs "
+                             "direct,separable,dft."
+                          << std::endl;
+                return EXIT_FAILURE;
+            }
+            fsiv_set_conv_cost_model(model);
+        }
+        user_data.threshold = parser.get<double>("t");
+        if (user_data.threshold < 0.0 || user_data.threshold > 1.0)
+        {
+            std::cerr << "Error: t must be in [0.0, 1.0]." << std::endl;
+            return EXIT_FAILURE;
+        }
+        // The luma, multi-scale and adaptive modes are different enhances:
+        // do_the_work() would only run one of them.
+        if (int(parser.has("y")) + int(parser.has("m")) +
+                int(user_data.threshold > 0.0) > 1)
+        {
+            std::cerr << "Error: only one of m, t and y can be used." << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (parser.has("m"))
+        {
+            if (!parse_scales(parser.get<cv::String>("m"), user_data.ms_radii,
+                              user_data.ms_gains))
+            {
+                std::cerr << "Error: m must be a list of radius:gain with "
+                             "increasing radii."
+                          << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
         user_data.circular = parser.has("c");
         user_data.interactive = parser.has("i");
 
@@ -172,6 +371,19 @@ int main(int argc, char *const *argv)
             return EXIT_FAILURE;
         }
 
+        const int band_rows = parser.get<int>("s");
+        if (band_rows > 0)
+        {
+            if (user_data.circular || user_data.interactive ||
+                parser.has("m") || parser.has("y") || user_data.threshold > 0.0)
+            {
+                std::cerr << "Error: s can not be used with c, i, m, t or y."
+                          << std::endl;
+                return EXIT_FAILURE;
+            }
+            return stream_pgm(input_n, output_n, user_data, band_rows);
+        }
+
         cv::Mat in = cv::imread(input_n, cv::IMREAD_UNCHANGED);
         if (in.empty())
         {
@@ -180,17 +392,30 @@ int main(int argc, char *const *argv)
             return EXIT_FAILURE;
         }
 
-        in.convertTo(user_data.in, CV_32F, 1.0 / 255.0);
-
-        if (user_data.in.channels() == 3)
+        if (parser.has("y") && in.type() != CV_8UC3)
         {
+            std::cerr << "Error: y needs an 8-bit color image." << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (parser.has("y"))
+        {
+            // The luma mode works on the 8-bit image directly.
+            user_data.in = in;
+            user_data.in_bgr = in;
+        }
+        else if (in.channels() == 3)
+        {
+            in.convertTo(user_data.in, CV_32F, 1.0 / 255.0);
             cv::Mat hsv;
             cv::cvtColor(user_data.in, hsv, cv::COLOR_BGR2HSV);
             cv::split(hsv, user_data.channels);
             user_data.luma = user_data.channels[2];
         }
         else
+        {
+            in.convertTo(user_data.in, CV_32F, 1.0 / 255.0);
             user_data.luma = user_data.in;
+        }
 
         int k = 0;
 
@@ -200,10 +425,15 @@ int main(int argc, char *const *argv)
             cv::imshow("INPUT", user_data.in);
             cv::namedWindow("OUTPUT", cv::WINDOW_GUI_EXPANDED);
             cv::namedWindow("UNSHARP MASK", cv::WINDOW_GUI_EXPANDED);
-            cv::createTrackbar("R", "OUTPUT", &user_data.r, std::min(in.rows, in.cols) / 2 - 1, on_change_r, &user_data);
+            // The multi-scale enhance takes its radii and gains from m, so
+            // only the border can be changed interactively.
             int g_int = static_cast<int>(std::min(10.0, user_data.g * 10.0));
-            cv::createTrackbar("G", "OUTPUT", &g_int, 100, on_change_g, &user_data);
-            cv::createTrackbar("Filter", "OUTPUT", &user_data.f, 1, on_change_f, &user_data);
+            if (user_data.ms_radii.empty())
+            {
+                cv::createTrackbar("R", "OUTPUT", &user_data.r, std::min(in.rows, in.cols) / 2 - 1, on_change_r, &user_data);
+                cv::createTrackbar("G", "OUTPUT", &g_int, 100, on_change_g, &user_data);
+                cv::createTrackbar("Filter", "OUTPUT", &user_data.f, 1, on_change_f, &user_data);
+            }
             cv::createTrackbar("Circular", "OUTPUT", &user_data.circular, 1, on_change_c, &user_data);
             do_the_work(&user_data);
             k = cv::waitKey(0) & 0xff;
@@ -213,8 +443,9 @@ int main(int argc, char *const *argv)
 
         if (k != 27)
         {
-            cv::Mat out;
-            user_data.out.convertTo(out, CV_8U, 255.0);
+            cv::Mat out = user_data.out;
+            if (out.depth() != CV_8U)
+                user_data.out.convertTo(out, CV_8U, 255.0);
             cv::imwrite(output_n, out);
         }
     }